@@ -0,0 +1,121 @@
+#ifndef BOOK_SNAPSHOT_HPP
+#define BOOK_SNAPSHOT_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "LockProfile.hpp"
+
+constexpr size_t BOOK_SNAPSHOT_DEPTH = 5; // levels published per side
+
+struct DepthLevel
+{
+	uint32_t price;
+	uint32_t volume;
+	uint32_t orders;
+};
+
+/*
+ * BookSnapshot is a consistent copy of the top of one book.
+ * bids[0] / asks[0] are the best bid and offer. version counts the
+ * publications so far, so a reader can tell whether anything changed.
+ */
+struct BookSnapshot
+{
+	uint64_t version;
+	size_t bid_levels;
+	size_t ask_levels;
+	DepthLevel bids[BOOK_SNAPSHOT_DEPTH];
+	DepthLevel asks[BOOK_SNAPSHOT_DEPTH];
+};
+
+/*
+ * PublishedSnapshot holds the published top levels of both sides of a book
+ * behind a seqlock. Writers republish a side while holding that side's lock;
+ * sides of the same book can be written by different threads, so publishing
+ * also takes a small mutex of its own, unless the book has a single writer.
+ * Readers take no lock: they copy the snapshot and retry if a publication
+ * overlapped. Each operation publishes the side it takes liquidity from before
+ * the side it rests on, so a reader never sees a crossed book.
+ */
+class PublishedSnapshot
+{
+private:
+	struct Level
+	{
+		std::atomic<uint32_t> price{0};
+		std::atomic<uint32_t> volume{0};
+		std::atomic<uint32_t> orders{0};
+	};
+
+	struct Side
+	{
+		std::atomic<uint32_t> count{0};
+		Level levels[BOOK_SNAPSHOT_DEPTH];
+	};
+
+	// Stores to the snapshot are releases and loads acquires, so a reader that
+	// sees any part of a publication also sees the odd sequence number.
+	alignas(64) std::atomic<uint64_t> seq{0};
+	Side sides[2]; // bids, asks
+	ProfiledMutex<LockClass::Snapshot> mtx;
+
+	static void copy(const Side &side, DepthLevel *out, size_t &count)
+	{
+		count = side.count.load(std::memory_order_acquire);
+		if (count > BOOK_SNAPSHOT_DEPTH)
+			count = BOOK_SNAPSHOT_DEPTH;
+		for (size_t i = 0; i < count; ++i)
+		{
+			out[i].price = side.levels[i].price.load(std::memory_order_acquire);
+			out[i].volume = side.levels[i].volume.load(std::memory_order_acquire);
+			out[i].orders = side.levels[i].orders.load(std::memory_order_acquire);
+		}
+	}
+
+public:
+	void publish(bool bid_side, const DepthLevel *levels, size_t count, bool locked)
+	{
+		std::unique_lock lock(mtx, std::defer_lock);
+		if (locked)
+			lock.lock();
+
+		Side &side = sides[bid_side ? 0 : 1];
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		for (size_t i = 0; i < count; ++i)
+		{
+			side.levels[i].price.store(levels[i].price, std::memory_order_release);
+			side.levels[i].volume.store(levels[i].volume, std::memory_order_release);
+			side.levels[i].orders.store(levels[i].orders, std::memory_order_release);
+		}
+		side.count.store(static_cast<uint32_t>(count), std::memory_order_release);
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	void read(BookSnapshot &snapshot) const
+	{
+		while (true)
+		{
+			uint64_t before = seq.load(std::memory_order_acquire);
+			if (before & 1)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			copy(sides[0], snapshot.bids, snapshot.bid_levels);
+			copy(sides[1], snapshot.asks, snapshot.ask_levels);
+
+			if (seq.load(std::memory_order_relaxed) == before)
+			{
+				snapshot.version = before / 2;
+				return;
+			}
+		}
+	}
+};
+
+#endif
@@ -1,31 +1,141 @@
 #ifndef HASH_MAP_HPP
 #define HASH_MAP_HPP
 
+#include "Epoch.hpp"
 #include "HashBucket.hpp"
+#include <atomic>
 #include <vector>
+#include <memory>
 #include <cstdint>
 #include <functional>
 #include <mutex>
 
 constexpr size_t HASH_SIZE_DEFAULT = 2027; // prime number for better distribution
+constexpr size_t HASH_MAX_LOAD = 2;        // grow past 2 nodes per bucket on average
+constexpr size_t HASH_MIN_LOAD_INVERSE = 8; // shrink below 1 node per 8 buckets
+constexpr size_t HASH_MIGRATE_STEP = 8;     // nodes each write moves while resizing
+constexpr size_t HASH_MIGRATE_SCAN = 64;    // at most this many buckets, mostly empty ones
+constexpr size_t HASH_COUNT_STRIPES = 16;   // must be a power of two
+constexpr size_t HASH_LOAD_CHECK = 64;      // a stripe checks the load every this many changes
 
+/*
+ * ConcurrentHashMap is a chained hash map with a lock per bucket that grows
+ * and shrinks online.
+ *
+ * The number of entries is kept in striped counters, and every so often a
+ * write checks the load factor. Past HASH_MAX_LOAD the map starts moving into
+ * a table twice the size; below 1/HASH_MIN_LOAD_INVERSE into one half the size,
+ * never below the initial size. Moving is incremental: each insert or erase
+ * moves the next HASH_MIGRATE_STEP buckets, one bucket at a time under its
+ * lock, and the map switches over once every bucket has moved. Operations
+ * start at the current table and follow a moved bucket to the next table.
+ * Lookups take no lock (see HashBucket). Every operation runs under an
+ * Epoch::Guard, so a table that has been moved out of is retired through
+ * Epoch and freed once no operation can still be passing through it.
+ */
 template <typename K, typename V, typename F = std::hash<K>>
 class ConcurrentHashMap
 {
 private:
-    std::vector<HashBucket<K, V>> buckets;
+    struct Table
+    {
+        std::vector<HashBucket<K, V>> buckets;
+        std::atomic<Table *> next;             // set while moving into another table
+        std::atomic<size_t> migrate_cursor;    // next bucket to hand out for moving
+        std::atomic<size_t> migrated;          // buckets done moving
+
+        explicit Table(size_t size) : buckets(size), next(nullptr), migrate_cursor(0), migrated(0) {}
+    };
+
+    struct alignas(64) CountStripe
+    {
+        std::atomic<int64_t> count{0};
+    };
+
     F hashFn;
-    const size_t hashSize;
+    const size_t minSize;
+    std::atomic<Table *> current;
+    CountStripe counts[HASH_COUNT_STRIPES];
+
+    ProfiledMutex<LockClass::MapResize> resizeMtx; // starting and finishing a resize
+
+    void countChange(size_t hash, int64_t delta)
+    {
+        auto &stripe = counts[hash & (HASH_COUNT_STRIPES - 1)];
+        int64_t count = stripe.count.fetch_add(delta, std::memory_order_relaxed) + delta;
+        if (count % HASH_LOAD_CHECK == 0)
+            checkLoad();
+    }
+
+    void checkLoad()
+    {
+        Table *table = current.load(std::memory_order_acquire);
+        if (table->next.load(std::memory_order_relaxed))
+            return;
+
+        size_t entries = size();
+        size_t buckets = table->buckets.size();
+        size_t target = buckets;
+        if (entries > buckets * HASH_MAX_LOAD)
+            target = buckets * 2;
+        else if (entries * HASH_MIN_LOAD_INVERSE < buckets && buckets / 2 >= minSize)
+            target = buckets / 2;
+        if (target == buckets)
+            return;
+
+        std::scoped_lock lock(resizeMtx);
+        if (current.load(std::memory_order_relaxed) != table || table->next.load(std::memory_order_relaxed))
+            return;
+
+        table->next.store(new Table(target), std::memory_order_release);
+    }
 
-    size_t computeHash(const K &key) const
+    // moves a few buckets of the table being resized, if any
+    void migrateStep()
     {
-        return hashFn(key) % hashSize;
+        Table *table = current.load(std::memory_order_acquire);
+        Table *next = table->next.load(std::memory_order_acquire);
+        if (!next)
+            return;
+
+        size_t size = table->buckets.size();
+        size_t nodes = 0;
+        for (size_t scanned = 0; scanned < HASH_MIGRATE_SCAN && nodes < HASH_MIGRATE_STEP; ++scanned)
+        {
+            size_t index = table->migrate_cursor.fetch_add(1, std::memory_order_relaxed);
+            if (index >= size)
+                return;
+
+            nodes += table->buckets[index].migrate([this, next](HashNode<K, V> *node)
+            {
+                size_t hash = hashFn(node->getKey());
+                next->buckets[hash % next->buckets.size()].adopt(node);
+            });
+
+            if (table->migrated.fetch_add(1, std::memory_order_acq_rel) + 1 == size)
+            {
+                // last bucket moved, switch over
+                {
+                    std::scoped_lock lock(resizeMtx);
+                    current.store(next, std::memory_order_release);
+                }
+                Epoch::retire(table, [](void *ptr) { delete static_cast<Table *>(ptr); });
+                // the load may have moved on while we were resizing
+                checkLoad();
+                return;
+            }
+        }
     }
 
 public:
-    ConcurrentHashMap(size_t hashSize_ = HASH_SIZE_DEFAULT) : buckets(hashSize_), hashSize(hashSize_) {}
+    ConcurrentHashMap(size_t hashSize_ = HASH_SIZE_DEFAULT) : hashFn(), minSize(hashSize_), current(new Table(hashSize_)) {}
 
-    ~ConcurrentHashMap() = default;
+    ~ConcurrentHashMap()
+    {
+        Table *table = current.load(std::memory_order_acquire);
+        delete table->next.load(std::memory_order_acquire);
+        delete table;
+    }
 
     ConcurrentHashMap(const ConcurrentHashMap &) = delete;
     ConcurrentHashMap(ConcurrentHashMap &&) = delete;
@@ -34,27 +144,88 @@ public:
 
     bool find(const K &key, V &value) const
     {
-        return buckets[computeHash(key)].find(key, value);
+        Epoch::Guard guard;
+        size_t hash = hashFn(key);
+        // follow moved buckets to the table that holds key
+        for (Table *table = current.load(std::memory_order_acquire);; table = table->next.load(std::memory_order_acquire))
+        {
+            bool moved = false;
+            bool found = table->buckets[hash % table->buckets.size()].find(key, value, moved);
+            if (!moved)
+                return found;
+        }
     }
 
-    // If key already exists, update the value, else do nothing 
+    // If key already exists, update the value
     void insert(const K &key, const V &value)
     {
-        buckets[computeHash(key)].insert(key, value);
+        Epoch::Guard guard;
+        migrateStep();
+
+        size_t hash = hashFn(key);
+        for (Table *table = current.load(std::memory_order_acquire);; table = table->next.load(std::memory_order_acquire))
+        {
+            bool moved = false;
+            bool added = table->buckets[hash % table->buckets.size()].insert(key, value, moved);
+            if (moved)
+                continue;
+            if (added)
+                countChange(hash, 1);
+            return;
+        }
     }
 
     void erase(const K &key)
     {
-        buckets[computeHash(key)].erase(key);
+        Epoch::Guard guard;
+        migrateStep();
+
+        size_t hash = hashFn(key);
+        for (Table *table = current.load(std::memory_order_acquire);; table = table->next.load(std::memory_order_acquire))
+        {
+            bool moved = false;
+            bool removed = table->buckets[hash % table->buckets.size()].erase(key, moved);
+            if (moved)
+                continue;
+            if (removed)
+                countChange(hash, -1);
+            return;
+        }
     }
 
     void clear()
     {
-        for (auto &bucket : buckets)
+        Epoch::Guard guard;
+        std::scoped_lock lock(resizeMtx);
+        for (Table *table = current.load(std::memory_order_acquire); table; table = table->next.load(std::memory_order_acquire))
         {
-            bucket.clear();
+            for (auto &bucket : table->buckets)
+            {
+                bucket.clear();
+            }
         }
+        for (auto &stripe : counts)
+        {
+            stripe.count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    size_t size() const
+    {
+        int64_t total = 0;
+        for (auto &stripe : counts)
+        {
+            total += stripe.count.load(std::memory_order_relaxed);
+        }
+        return total > 0 ? static_cast<size_t>(total) : 0;
+    }
+
+    // entries per bucket of the current table
+    double loadFactor() const
+    {
+        Epoch::Guard guard;
+        return static_cast<double>(size()) / static_cast<double>(current.load(std::memory_order_acquire)->buckets.size());
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,150 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+constexpr size_t EPOCH_RECLAIM_BATCH = 64; // retired objects a thread collects before trying to free them
+
+/*
+ * Epoch implements epoch-based reclamation for lock-free readers.
+ *
+ * A reader holds an Epoch::Guard while it may touch shared objects. Entering
+ * announces the global epoch in the thread's own record, on its own cache line,
+ * so readers never write memory other threads write. Writers unlink an object
+ * and then retire() it; it is only destroyed once the global epoch has moved
+ * two steps past the epoch it was retired in, which guarantees every reader
+ * that could have seen it has left its guard. The epoch only advances when
+ * every thread inside a guard has announced the current one.
+ * Records belong to a thread while it lives and are reused by later threads,
+ * together with anything still waiting in them.
+ */
+class Epoch
+{
+public:
+    class Guard
+    {
+    public:
+        Guard() { enter(); }
+        ~Guard() { leave(); }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    // Destroys ptr with deleter once no reader can hold it.
+    static void retire(void *ptr, void (*deleter)(void *))
+    {
+        Record &record = local();
+        record.limbo.push_back(Retired{ptr, deleter, global.load(std::memory_order_acquire)});
+        if (record.limbo.size() >= EPOCH_RECLAIM_BATCH)
+        {
+            tryAdvance();
+            reclaim(record);
+        }
+    }
+
+private:
+    struct Retired
+    {
+        void *ptr;
+        void (*deleter)(void *);
+        uint64_t epoch;
+    };
+
+    struct alignas(64) Record
+    {
+        std::atomic<uint64_t> active{0}; // epoch announced by the thread in a guard, 0 outside
+        std::atomic<bool> owned{true};
+        Record *next = nullptr;
+        uint32_t depth = 0;
+        std::vector<Retired> limbo; // in retire order, so in epoch order
+    };
+
+    struct Owner
+    {
+        Record *record;
+
+        Owner() : record(nullptr) {}
+
+        ~Owner()
+        {
+            if (record)
+                record->owned.store(false, std::memory_order_release);
+        }
+    };
+
+    static inline std::atomic<uint64_t> global{1};
+    static inline std::atomic<Record *> records{nullptr}; // every record ever made, never freed
+    static inline thread_local Owner owner;
+
+    static Record &local()
+    {
+        if (owner.record)
+            return *owner.record;
+
+        for (Record *record = records.load(std::memory_order_acquire); record; record = record->next)
+        {
+            bool owned = false;
+            if (!record->owned.load(std::memory_order_relaxed) &&
+                record->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+            {
+                owner.record = record;
+                return *record;
+            }
+        }
+
+        Record *record = new Record();
+        record->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+        owner.record = record;
+        return *record;
+    }
+
+    static void enter()
+    {
+        Record &record = local();
+        if (record.depth++ == 0)
+        {
+            // seq_cst orders the announcement before any read of the shared objects
+            record.active.store(global.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+        }
+    }
+
+    static void leave()
+    {
+        Record &record = *owner.record;
+        if (--record.depth == 0)
+            record.active.store(0, std::memory_order_release);
+    }
+
+    static void tryAdvance()
+    {
+        uint64_t epoch = global.load(std::memory_order_seq_cst);
+        for (Record *record = records.load(std::memory_order_acquire); record; record = record->next)
+        {
+            uint64_t active = record->active.load(std::memory_order_seq_cst);
+            if (active != 0 && active != epoch)
+                return;
+        }
+        global.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    }
+
+    static void reclaim(Record &record)
+    {
+        uint64_t epoch = global.load(std::memory_order_acquire);
+        size_t done = 0;
+        while (done < record.limbo.size() && record.limbo[done].epoch + 2 <= epoch)
+        {
+            record.limbo[done].deleter(record.limbo[done].ptr);
+            ++done;
+        }
+        record.limbo.erase(record.limbo.begin(), record.limbo.begin() + static_cast<std::ptrdiff_t>(done));
+    }
+};
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef FLAT_HASH_MAP_HPP
+#define FLAT_HASH_MAP_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+#include "LockProfile.hpp"
+
+constexpr size_t FLAT_MAP_SEGMENTS = 64;          // lock stripes, must be a power of two
+constexpr size_t FLAT_MAP_SEGMENT_INITIAL = 1024; // slots per segment, must be a power of two
+constexpr size_t FLAT_MAP_ALIGNMENT = 64;         // cache line
+
+/*
+ * FlatHashMap is a concurrent hash map for integer keys, laid out for the
+ * order id -> OrderHandle map: no node per entry and no pointer chasing.
+ *
+ * Keys are spread over FLAT_MAP_SEGMENTS segments, each guarded by its own
+ * mutex (lock striping). A segment is an open-addressing table with linear
+ * probing in flat, cache-line aligned arrays: a control byte per slot (0 for
+ * empty, otherwise 0x80 plus 7 bits of the hash) so most probes touch only the
+ * dense control array, and the key/value slots themselves.
+ * Erase shifts the following entries back instead of leaving tombstones, so
+ * probe sequences stay short under insert/erase churn. A segment doubles in
+ * place when it is 3/4 full.
+ * Values are copied in and out, like ConcurrentHashMap, so they must be
+ * trivially copyable.
+ */
+template <typename K, typename V>
+class FlatHashMap
+{
+private:
+    static_assert(std::is_integral_v<K>, "FlatHashMap keys must be integers");
+    static_assert(std::is_trivially_copyable_v<V>, "FlatHashMap values must be trivially copyable");
+
+    struct Slot
+    {
+        K key;
+        V value;
+    };
+
+    struct alignas(FLAT_MAP_ALIGNMENT) Segment
+    {
+        mutable ProfiledMutex<LockClass::OrderMap> mtx;
+        uint8_t *ctrl = nullptr;
+        Slot *slots = nullptr;
+        size_t mask = 0;
+        size_t count = 0;
+    };
+
+    Segment segments[FLAT_MAP_SEGMENTS];
+
+    static uint64_t hash(K key)
+    {
+        uint64_t h = static_cast<uint64_t>(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // the top bits pick the segment, the low bits the slot
+    Segment &segmentFor(uint64_t h) { return segments[h >> (64 - std::countr_zero(FLAT_MAP_SEGMENTS))]; }
+    const Segment &segmentFor(uint64_t h) const { return segments[h >> (64 - std::countr_zero(FLAT_MAP_SEGMENTS))]; }
+
+    static uint8_t tag(uint64_t h) { return static_cast<uint8_t>(0x80 | (h & 0x7f)); }
+    static size_t home(const Segment &segment, uint64_t h) { return (h >> 7) & segment.mask; }
+
+    template <typename T>
+    static T *allocate(size_t n)
+    {
+        auto *array = static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t{FLAT_MAP_ALIGNMENT}));
+        for (size_t i = 0; i < n; ++i)
+            new (&array[i]) T{};
+        return array;
+    }
+
+    template <typename T>
+    static void deallocate(T *array)
+    {
+        ::operator delete(array, std::align_val_t{FLAT_MAP_ALIGNMENT});
+    }
+
+    static void allocate(Segment &segment, size_t size)
+    {
+        segment.ctrl = allocate<uint8_t>(size);
+        segment.slots = allocate<Slot>(size);
+        segment.mask = size - 1;
+        segment.count = 0;
+    }
+
+    // slot index of key in segment, or SIZE_MAX
+    static size_t locate(const Segment &segment, K key, uint64_t h)
+    {
+        uint8_t t = tag(h);
+        for (size_t i = home(segment, h);; i = (i + 1) & segment.mask)
+        {
+            uint8_t c = segment.ctrl[i];
+            if (c == 0)
+                return SIZE_MAX;
+            if (c == t && segment.slots[i].key == key)
+                return i;
+        }
+    }
+
+    static void place(Segment &segment, K key, const V &value, uint64_t h)
+    {
+        size_t i = home(segment, h);
+        while (segment.ctrl[i] != 0)
+            i = (i + 1) & segment.mask;
+
+        segment.ctrl[i] = tag(h);
+        segment.slots[i] = Slot{key, value};
+        ++segment.count;
+    }
+
+    static void grow(Segment &segment)
+    {
+        uint8_t *old_ctrl = segment.ctrl;
+        Slot *old_slots = segment.slots;
+        size_t old_size = segment.mask + 1;
+
+        allocate(segment, old_size * 2);
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (old_ctrl[i] != 0)
+                place(segment, old_slots[i].key, old_slots[i].value, hash(old_slots[i].key));
+        }
+
+        deallocate(old_ctrl);
+        deallocate(old_slots);
+    }
+
+public:
+    FlatHashMap(size_t segment_size = FLAT_MAP_SEGMENT_INITIAL)
+    {
+        for (auto &segment : segments)
+            allocate(segment, segment_size);
+    }
+
+    ~FlatHashMap()
+    {
+        for (auto &segment : segments)
+        {
+            deallocate(segment.ctrl);
+            deallocate(segment.slots);
+        }
+    }
+
+    FlatHashMap(const FlatHashMap &) = delete;
+    FlatHashMap(FlatHashMap &&) = delete;
+    FlatHashMap &operator=(const FlatHashMap &) = delete;
+    FlatHashMap &operator=(FlatHashMap &&) = delete;
+
+    bool find(const K &key, V &value) const
+    {
+        uint64_t h = hash(key);
+        const Segment &segment = segmentFor(h);
+        std::scoped_lock lock(segment.mtx);
+
+        size_t i = locate(segment, key, h);
+        if (i == SIZE_MAX)
+            return false;
+        value = segment.slots[i].value;
+        return true;
+    }
+
+    // If key already exists, update the value
+    void insert(const K &key, const V &value)
+    {
+        uint64_t h = hash(key);
+        Segment &segment = segmentFor(h);
+        std::scoped_lock lock(segment.mtx);
+
+        size_t i = locate(segment, key, h);
+        if (i != SIZE_MAX)
+        {
+            segment.slots[i].value = value;
+            return;
+        }
+
+        if ((segment.count + 1) * 4 > (segment.mask + 1) * 3)
+            grow(segment);
+        place(segment, key, value, h);
+    }
+
+    void erase(const K &key)
+    {
+        uint64_t h = hash(key);
+        Segment &segment = segmentFor(h);
+        std::scoped_lock lock(segment.mtx);
+
+        size_t hole = locate(segment, key, h);
+        if (hole == SIZE_MAX)
+            return;
+
+        // shift back every following entry of the run that may sit at the hole
+        for (size_t i = (hole + 1) & segment.mask; segment.ctrl[i] != 0; i = (i + 1) & segment.mask)
+        {
+            size_t want = home(segment, hash(segment.slots[i].key));
+            // distance from its home to i vs from its home to the hole
+            if (((i - want) & segment.mask) >= ((i - hole) & segment.mask))
+            {
+                segment.ctrl[hole] = segment.ctrl[i];
+                segment.slots[hole] = segment.slots[i];
+                hole = i;
+            }
+        }
+
+        segment.ctrl[hole] = 0;
+        --segment.count;
+    }
+
+    void clear()
+    {
+        for (auto &segment : segments)
+        {
+            std::scoped_lock lock(segment.mtx);
+            for (size_t i = 0; i <= segment.mask; ++i)
+                segment.ctrl[i] = 0;
+            segment.count = 0;
+        }
+    }
+};
+
+#endif
@@ -1,83 +1,201 @@
 #ifndef HASHBUCKET_HPP
 #define HASHBUCKET_HPP
 
+#include "Epoch.hpp"
 #include "HashNode.hpp"
-#include <shared_mutex>
+#include "LockProfile.hpp"
+#include "ObjectPool.hpp"
+#include <atomic>
 #include <mutex>
+#include <thread>
 
+/*
+ * HashBucket is one chain of a ConcurrentHashMap table.
+ *
+ * Writers serialise on mtx and bracket every change with a sequence counter,
+ * which is odd while a change is under way. Readers take no lock: they walk the
+ * chain optimistically and keep the result only if the counter was even and
+ * unchanged throughout, retrying otherwise, so a lookup writes no shared memory.
+ * Nodes never change once linked; updating a value links a new node in place
+ * of the old one. Unlinked nodes are retired through Epoch, so readers must
+ * hold an Epoch::Guard and a node they reach stays valid until they let go.
+ *
+ * When the map resizes, migrate() moves every node to the next table and marks
+ * the bucket moved for good; operations then report moved instead of acting,
+ * and the caller retries in the next table.
+ */
 template <typename K, typename V>
 class HashBucket
 {
 private:
-    std::unique_ptr<HashNode<K, V>> head;
-    mutable std::shared_mutex mtx;
+    using Node = HashNode<K, V>;
+
+    std::atomic<Node*> head;
+    std::atomic<bool> moved;
+    std::atomic<uint32_t> seq;
+    ProfiledMutex<LockClass::HashBucket> mtx; // writers only
+
+    static void retire(Node* node)
+    {
+        Epoch::retire(node, [](void* ptr) { ObjectPool<Node>::destroy(static_cast<Node*>(ptr)); });
+    }
+
+    // Called with mtx held. Every store to the chain after beginWrite() is a
+    // release and every load a reader makes an acquire, so a reader that sees
+    // any of the change also sees the odd sequence number when it re-checks.
+    void beginWrite()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void endWrite()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // the link pointing at node: head or the next of prev
+    std::atomic<Node*> &linkTo(Node* prev) { return prev ? prev->next : head; }
 
 public:
-    HashBucket() : head(nullptr) {}
+    HashBucket() : head(nullptr), moved(false), seq(0) {}
 
-    ~HashBucket() { clear(); }
+    // no reader can be left when a bucket is destroyed
+    ~HashBucket()
+    {
+        for (Node* node = head.load(std::memory_order_relaxed); node; )
+        {
+            Node* next = node->next.load(std::memory_order_relaxed);
+            ObjectPool<Node>::destroy(node);
+            node = next;
+        }
+    }
 
-    bool find(const K &key, V &value) const
+    bool find(const K &key, V &value, bool &was_moved) const
     {
-        std::shared_lock lock(mtx);
-        for (auto* node = head.get(); node != nullptr; node = node->getNext())
+        while (true)
         {
-            if (node->getKey() == key)
+            uint32_t before = seq.load(std::memory_order_acquire);
+            if (before & 1)
             {
-                value = node->getValue();
-                return true;
+                std::this_thread::yield();
+                continue;
+            }
+
+            bool found = false;
+            bool is_moved = moved.load(std::memory_order_acquire);
+            for (auto* node = head.load(std::memory_order_acquire); node != nullptr; node = node->getNext())
+            {
+                if (node->getKey() == key)
+                {
+                    value = node->getValue();
+                    found = true;
+                    break;
+                }
+            }
+
+            if (seq.load(std::memory_order_relaxed) == before)
+            {
+                was_moved = is_moved;
+                return found;
             }
         }
-        return false;
     }
 
-    void insert(const K &key, const V &value)
+    // Returns true if a node was added, false if the key was updated (or the bucket has moved)
+    bool insert(const K &key, const V &value, bool &was_moved)
     {
         std::unique_lock lock(mtx);
+        was_moved = moved.load(std::memory_order_relaxed);
+        if (was_moved)
+            return false;
 
-        for (auto* node = head.get(); node != nullptr; node = node->getNext())
+        Node* prev = nullptr;
+        for (auto* node = head.load(std::memory_order_relaxed); node != nullptr; prev = node, node = node->getNext())
         {
             if (node->getKey() == key)
             {
-                node->setValue(value);
-                return;
+                auto* replacement = ObjectPool<Node>::create(key, value);
+                replacement->next.store(node->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                beginWrite();
+                linkTo(prev).store(replacement, std::memory_order_release);
+                endWrite();
+                retire(node);
+                return false;
             }
         }
 
-        auto newNode = std::make_unique<HashNode<K, V>>(key, value);
-        newNode->next = std::move(head);
-        head = std::move(newNode);
+        auto* newNode = ObjectPool<Node>::create(key, value);
+        newNode->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        beginWrite();
+        head.store(newNode, std::memory_order_release);
+        endWrite();
+        return true;
     }
 
-    void erase(const K &key)
+    // Returns true if a node was removed
+    bool erase(const K &key, bool &was_moved)
     {
         std::unique_lock lock(mtx);
+        was_moved = moved.load(std::memory_order_relaxed);
 
-        // if removing the head 
-        if (head && head->getKey() == key)
-        {
-            head = std::move(head->next);
-            return;
-        }
-
-        for (auto* node = head.get(); node != nullptr; )
+        Node* prev = nullptr;
+        for (auto* node = head.load(std::memory_order_relaxed); node != nullptr; prev = node, node = node->getNext())
         {
-            auto* nextNode = node->getNext();
-            if (nextNode && nextNode->getKey() == key)
+            if (node->getKey() == key)
             {
-                node->next = std::move(nextNode->next);
-                return;
+                beginWrite();
+                linkTo(prev).store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+                endWrite();
+                retire(node);
+                return true;
             }
-            node = nextNode;
         }
+        return false;
+    }
+
+    // Links in a node moved from another bucket, whose key cannot be here yet
+    void adopt(Node* node)
+    {
+        std::unique_lock lock(mtx);
+        beginWrite();
+        node->next.store(head.load(std::memory_order_relaxed), std::memory_order_release);
+        head.store(node, std::memory_order_release);
+        endWrite();
     }
 
+    // Hands every node to place(node), marks the bucket moved and returns the number of nodes.
+    // The bucket stays locked throughout, so no operation sees the key in neither table.
+    template <typename Place>
+    size_t migrate(Place &&place)
+    {
+        std::unique_lock lock(mtx);
+        size_t count = 0;
+        beginWrite();
+        for (auto* node = head.load(std::memory_order_relaxed); node != nullptr; ++count)
+        {
+            auto* next = node->next.load(std::memory_order_relaxed);
+            place(node);
+            node = next;
+        }
+        head.store(nullptr, std::memory_order_release);
+        moved.store(true, std::memory_order_release);
+        endWrite();
+        return count;
+    }
 
     void clear()
     {
         std::unique_lock lock(mtx);
-        head.reset();
+        beginWrite();
+        auto* node = head.exchange(nullptr, std::memory_order_release);
+        endWrite();
+        while (node)
+        {
+            auto* next = node->next.load(std::memory_order_relaxed);
+            retire(node);
+            node = next;
+        }
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,6 +1,9 @@
 #ifndef HASHNODE_HPP
 #define HASHNODE_HPP
 
+#include <atomic>
+
+// key and value never change once a node is linked, so lock-free readers can copy them
 template <typename K, typename V>
 class HashNode
 {
@@ -10,7 +13,7 @@ private:
     V value;
 
 public:
-    std::unique_ptr<HashNode> next;
+    std::atomic<HashNode*> next;
     HashNode(const K &key, const V &value) : key(key), value(value), next(nullptr) {}
 
     ~HashNode() = default;
@@ -22,9 +25,8 @@ public:
 
     const K &getKey() const {return key;}
     const V &getValue() const { return value; }
-    void setValue(const V &value) { this->value = value; }
 
-    HashNode* getNext() const { return next.get(); }
+    HashNode* getNext() const { return next.load(std::memory_order_acquire); }
 };
 
-#endif 
+#endif
@@ -0,0 +1,185 @@
+#ifndef INSTRUMENT_HPP
+#define INSTRUMENT_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "LockProfile.hpp"
+
+/*
+ * Instrument symbols are at most 8 characters, so they are packed into a
+ * uint64_t, first character in the lowest byte and zero padded.
+ */
+inline uint64_t packSymbol(const char *symbol)
+{
+	uint64_t packed = 0;
+	for (size_t i = 0; i < 8 && symbol[i] != '\0'; ++i)
+	{
+		packed |= static_cast<uint64_t>(static_cast<unsigned char>(symbol[i])) << (8 * i);
+	}
+	return packed;
+}
+
+// Writes the symbol back out as a NUL terminated string.
+inline void unpackSymbol(uint64_t packed, char (&symbol)[9])
+{
+	for (size_t i = 0; i < 8; ++i)
+	{
+		symbol[i] = static_cast<char>(packed >> (8 * i));
+	}
+	symbol[8] = '\0';
+}
+
+// Packed symbols share most of their bytes, so mix them before bucketing.
+struct SymbolHash
+{
+	size_t operator()(uint64_t packed) const
+	{
+		packed ^= packed >> 33;
+		packed *= 0xff51afd7ed558ccdULL;
+		packed ^= packed >> 33;
+		return static_cast<size_t>(packed);
+	}
+};
+
+constexpr size_t INSTRUMENT_DIRECTORY_INITIAL_SIZE = 64; // must be a power of two
+
+/*
+ * InstrumentDirectory maps packed symbols to the Book of each instrument and
+ * hands out dense instrument ids (0, 1, 2, ...) as books are created.
+ *
+ * Lookups are wait-free: they probe an open-addressing table published through
+ * an atomic pointer and take no lock. A slot is claimed by writing its symbol
+ * and then publishing its book, so a reader that sees a book also sees its
+ * symbol. Creating a book is rare and done under a mutex, which makes
+ * get-or-create atomic: racing threads all get the same book.
+ * When the table is half full it is copied into one twice the size and the new
+ * table is published. Old tables are only freed with the directory, since a
+ * reader may still be probing them; with doubling they add up to less than the
+ * current table.
+ */
+template <typename Book>
+class InstrumentDirectory
+{
+private:
+	struct Slot
+	{
+		std::atomic<uint64_t> symbol{0};
+		std::atomic<Book *> book{nullptr};
+	};
+
+	struct Table
+	{
+		size_t mask;
+		size_t count;
+		std::unique_ptr<Slot[]> slots;
+
+		explicit Table(size_t size) : mask(size - 1), count(0), slots(new Slot[size]) {}
+	};
+
+	std::atomic<Table *> current;
+	ProfiledMutex<LockClass::Instruments> mtx;
+	std::vector<std::unique_ptr<Table>> tables; // every table ever published, guarded by mtx
+	uint32_t next_id = 0;                        // guarded by mtx
+
+	static Book *find(const Table *table, uint64_t symbol)
+	{
+		for (size_t i = SymbolHash{}(symbol) & table->mask;; i = (i + 1) & table->mask)
+		{
+			Book *book = table->slots[i].book.load(std::memory_order_acquire);
+			if (!book)
+				return nullptr;
+			if (table->slots[i].symbol.load(std::memory_order_relaxed) == symbol)
+				return book;
+		}
+	}
+
+	static void place(Table *table, uint64_t symbol, Book *book)
+	{
+		size_t i = SymbolHash{}(symbol) & table->mask;
+		while (table->slots[i].book.load(std::memory_order_relaxed))
+			i = (i + 1) & table->mask;
+
+		table->slots[i].symbol.store(symbol, std::memory_order_relaxed);
+		table->slots[i].book.store(book, std::memory_order_release);
+		++table->count;
+	}
+
+	Table *grow(Table *table)
+	{
+		size_t size = (table->mask + 1) * 2;
+		tables.push_back(std::make_unique<Table>(size));
+		Table *bigger = tables.back().get();
+
+		for (size_t i = 0; i <= table->mask; ++i)
+		{
+			Book *book = table->slots[i].book.load(std::memory_order_relaxed);
+			if (book)
+				place(bigger, table->slots[i].symbol.load(std::memory_order_relaxed), book);
+		}
+
+		current.store(bigger, std::memory_order_release);
+		return bigger;
+	}
+
+public:
+	InstrumentDirectory() : current(nullptr), mtx(), tables()
+	{
+		tables.push_back(std::make_unique<Table>(INSTRUMENT_DIRECTORY_INITIAL_SIZE));
+		current.store(tables.back().get(), std::memory_order_release);
+	}
+
+	~InstrumentDirectory()
+	{
+		Table *table = current.load(std::memory_order_acquire);
+		for (size_t i = 0; i <= table->mask; ++i)
+			delete table->slots[i].book.load(std::memory_order_relaxed);
+	}
+
+	InstrumentDirectory(const InstrumentDirectory &) = delete;
+	InstrumentDirectory &operator=(const InstrumentDirectory &) = delete;
+
+	Book *find(uint64_t symbol) const
+	{
+		return find(current.load(std::memory_order_acquire), symbol);
+	}
+
+	// Visits every book created so far. Books are never removed, so visit may
+	// use them after the call; a book created meanwhile may or may not be visited.
+	template <typename Visit>
+	void forEach(Visit &&visit) const
+	{
+		const Table *table = current.load(std::memory_order_acquire);
+		for (size_t i = 0; i <= table->mask; ++i)
+		{
+			if (Book *book = table->slots[i].book.load(std::memory_order_acquire))
+				visit(book);
+		}
+	}
+
+	// create(id, symbol) is called at most once per symbol, under the directory mutex
+	template <typename Create>
+	Book *getOrCreate(uint64_t symbol, Create &&create)
+	{
+		if (Book *book = find(symbol))
+			return book;
+
+		std::scoped_lock lock(mtx);
+		Table *table = current.load(std::memory_order_relaxed);
+		if (Book *book = find(table, symbol))
+			return book;
+
+		if ((table->count + 1) * 2 > table->mask + 1)
+			table = grow(table);
+
+		Book *book = create(next_id++, symbol);
+		place(table, symbol, book);
+		return book;
+	}
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef LATENCY_STATS_HPP
+#define LATENCY_STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+#include "PerThread.hpp"
+#include "Timestamp.hpp"
+
+constexpr unsigned LATENCY_SUB_BITS = 4;                   // 16 buckets per power of two, i.e. within 6%
+constexpr unsigned LATENCY_MAX_BITS = 40;                  // about 18 minutes in ns, longer is counted as that
+constexpr size_t LATENCY_SUB_BUCKETS = size_t(1) << LATENCY_SUB_BITS;
+constexpr size_t LATENCY_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS;
+
+/*
+ * LatencyHistogram counts durations in ns in log-linear buckets, HDR style:
+ * exact below 2 * LATENCY_SUB_BUCKETS, then LATENCY_SUB_BUCKETS buckets per
+ * power of two. It is written by one thread only, so recording is a load and
+ * a store; other threads may read it at any time and see each count either
+ * before or after an update.
+ */
+struct LatencyHistogram
+{
+	std::atomic<uint64_t> counts[LATENCY_BUCKETS];
+	std::atomic<uint64_t> max{0};
+
+	LatencyHistogram()
+	{
+		for (auto &count : counts)
+			count.store(0, std::memory_order_relaxed);
+	}
+
+	static size_t bucket(uint64_t ns)
+	{
+		if (ns < 2 * LATENCY_SUB_BUCKETS)
+			return static_cast<size_t>(ns);
+		unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(ns)) - LATENCY_SUB_BITS;
+		size_t index = LATENCY_SUB_BUCKETS * (shift + 1) + ((ns >> shift) - LATENCY_SUB_BUCKETS);
+		return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+	}
+
+	// The highest duration counted in a bucket.
+	static uint64_t upperBound(size_t index)
+	{
+		if (index < 2 * LATENCY_SUB_BUCKETS)
+			return index;
+		unsigned shift = static_cast<unsigned>(index / LATENCY_SUB_BUCKETS) - 1;
+		return ((LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+	}
+
+	void record(uint64_t ns)
+	{
+		auto &count = counts[bucket(ns)];
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (ns > max.load(std::memory_order_relaxed))
+			max.store(ns, std::memory_order_relaxed);
+	}
+};
+
+// Several histograms added up, for reporting.
+struct LatencySummary
+{
+	uint64_t counts[LATENCY_BUCKETS] = {};
+	uint64_t total = 0;
+	uint64_t max = 0;
+
+	void add(const LatencyHistogram &histogram)
+	{
+		for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+		{
+			uint64_t count = histogram.counts[i].load(std::memory_order_relaxed);
+			counts[i] += count;
+			total += count;
+		}
+		uint64_t histogram_max = histogram.max.load(std::memory_order_relaxed);
+		max = histogram_max > max ? histogram_max : max;
+	}
+
+	uint64_t percentile(double fraction) const
+	{
+		uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+		{
+			seen += counts[i];
+			if (seen > rank)
+				return LatencyHistogram::upperBound(i) < max ? LatencyHistogram::upperBound(i) : max;
+		}
+		return max;
+	}
+};
+
+enum class LatencyCommand
+{
+	Buy,
+	Sell,
+	Cancel,
+	Amend,
+	Count
+};
+
+enum class LatencyStage
+{
+	Lookup, // finding the book, or the order to cancel or amend
+	Lock,   // waiting for the book's locks
+	Match,  // in the book, less the output
+	Output, // writing or queueing the command's output lines
+	Total,  // the whole command
+	Count
+};
+
+/*
+ * LatencyStats keeps a LatencyHistogram per command type and stage, plus one
+ * for reading a batch of commands from a connection, for every thread, and
+ * adds them up when asked. Threads record without sharing anything, see
+ * PerThread.
+ * enabled is set once at startup, before any thread records; when it is not,
+ * recording costs a branch.
+ */
+class LatencyStats
+{
+public:
+	static inline bool enabled = false;
+
+	static LatencyCommand command(char type)
+	{
+		switch (type)
+		{
+		case 'B':
+			return LatencyCommand::Buy;
+		case 'S':
+			return LatencyCommand::Sell;
+		case 'A':
+			return LatencyCommand::Amend;
+		default:
+			return LatencyCommand::Cancel;
+		}
+	}
+
+	static void record(LatencyCommand command, LatencyStage stage, uint64_t ns)
+	{
+		local().stages[static_cast<size_t>(command)][static_cast<size_t>(stage)].record(ns);
+	}
+
+	// For stages timed by hand: start is clock() at the beginning of the stage.
+	static int64_t clock() { return enabled ? Timestamp::now() : 0; }
+
+	static void recordSince(LatencyCommand command, LatencyStage stage, int64_t start)
+	{
+		if (enabled)
+			record(command, stage, static_cast<uint64_t>(Timestamp::now() - start));
+	}
+
+	static void recordReadSince(int64_t start)
+	{
+		if (enabled)
+			local().read.record(static_cast<uint64_t>(Timestamp::now() - start));
+	}
+
+	// Writes p50/p99/p99.9/max and counts of every histogram recorded into.
+	static void dump(FILE *out)
+	{
+		static const char *commands[] = {"buy", "sell", "cancel", "amend"};
+		static const char *stages[] = {"lookup", "lock", "match", "output", "total"};
+
+		LatencySummary summaries[static_cast<size_t>(LatencyCommand::Count)][static_cast<size_t>(LatencyStage::Count)];
+		LatencySummary read;
+		PerThread<Storage>::forEach([&](const Storage &storage)
+		{
+			for (size_t c = 0; c < static_cast<size_t>(LatencyCommand::Count); ++c)
+				for (size_t s = 0; s < static_cast<size_t>(LatencyStage::Count); ++s)
+					summaries[c][s].add(storage.stages[c][s]);
+			read.add(storage.read);
+		});
+
+		fprintf(out, "%-7s %-7s %12s %10s %10s %10s %10s  (ns)\n", "command", "stage", "count", "p50", "p99", "p99.9", "max");
+		auto line = [out](const char *command, const char *stage, const LatencySummary &summary)
+		{
+			if (summary.total == 0)
+				return;
+			fprintf(out, "%-7s %-7s %12llu %10llu %10llu %10llu %10llu\n", command, stage,
+			        (unsigned long long)summary.total, (unsigned long long)summary.percentile(0.5),
+			        (unsigned long long)summary.percentile(0.99), (unsigned long long)summary.percentile(0.999),
+			        (unsigned long long)summary.max);
+		};
+		line("batch", "read", read);
+		for (size_t c = 0; c < static_cast<size_t>(LatencyCommand::Count); ++c)
+			for (size_t s = 0; s < static_cast<size_t>(LatencyStage::Count); ++s)
+				line(commands[c], stages[s], summaries[c][s]);
+		fflush(out);
+	}
+
+private:
+	struct Storage
+	{
+		LatencyHistogram stages[static_cast<size_t>(LatencyCommand::Count)][static_cast<size_t>(LatencyStage::Count)];
+		LatencyHistogram read;
+	};
+
+	static Storage &local() { return PerThread<Storage>::local(); }
+};
+
+/*
+ * CommandLatency times one command on the thread running it, stage by stage:
+ * each mark() ends the current stage. When it goes out of scope the rest of
+ * the command, less the time spent in output, is counted as matching.
+ */
+class CommandLatency
+{
+public:
+	explicit CommandLatency(char type) : command(LatencyStats::command(type))
+	{
+		if (!LatencyStats::enabled)
+			return;
+		start = last = Timestamp::now();
+		previous = current;
+		current = this;
+	}
+
+	~CommandLatency()
+	{
+		if (!LatencyStats::enabled)
+			return;
+		int64_t end = Timestamp::now();
+		uint64_t rest = static_cast<uint64_t>(end - last);
+		LatencyStats::record(command, LatencyStage::Match, rest > output_ns ? rest - output_ns : 0);
+		LatencyStats::record(command, LatencyStage::Output, output_ns);
+		LatencyStats::record(command, LatencyStage::Total, static_cast<uint64_t>(end - start));
+		current = previous;
+	}
+
+	CommandLatency(const CommandLatency &) = delete;
+	CommandLatency &operator=(const CommandLatency &) = delete;
+
+	// Ends a stage of the command being timed on this thread, if any.
+	static void mark(LatencyStage stage)
+	{
+		if (!LatencyStats::enabled || !current)
+			return;
+		int64_t now = Timestamp::now();
+		LatencyStats::record(current->command, stage, static_cast<uint64_t>(now - current->last));
+		current->last = now;
+	}
+
+	// Adds time spent writing output to the command being timed on this thread, if any.
+	static void addOutput(uint64_t ns)
+	{
+		if (current)
+			current->output_ns += ns;
+	}
+
+private:
+	LatencyCommand command;
+	int64_t start = 0;
+	int64_t last = 0;
+	uint64_t output_ns = 0;
+	CommandLatency *previous = nullptr;
+
+	static inline thread_local CommandLatency *current = nullptr;
+};
+
+// Times one line of output, see CommandLatency::addOutput.
+class OutputLatency
+{
+public:
+	OutputLatency() : start(LatencyStats::enabled ? Timestamp::now() : 0) {}
+
+	~OutputLatency()
+	{
+		if (LatencyStats::enabled)
+			CommandLatency::addOutput(static_cast<uint64_t>(Timestamp::now() - start));
+	}
+
+	OutputLatency(const OutputLatency &) = delete;
+	OutputLatency &operator=(const OutputLatency &) = delete;
+
+private:
+	int64_t start;
+};
+
+#endif
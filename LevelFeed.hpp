@@ -0,0 +1,83 @@
+#ifndef LEVEL_FEED_HPP
+#define LEVEL_FEED_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "LockProfile.hpp"
+
+/*
+ * LevelDelta is the latest state of a changed price level, and whether
+ * market-data consumers already know the level from an earlier publication.
+ */
+struct LevelDelta
+{
+	uint32_t volume; // 0 once the level is gone
+	uint32_t orders;
+	bool existed;
+};
+
+/*
+ * LevelFeed collects the price levels of one book that changed since they were
+ * last published. Changes are conflated: a level keeps only its latest state,
+ * so however slow the publisher, a book holds at most one entry per level and
+ * matching is never held up by it. Each side has its own small mutex, shared
+ * only with the publisher, since the sides are written under separate locks.
+ */
+class LevelFeed
+{
+public:
+	static inline bool enabled = false; // set once at startup, before any book exists
+
+	// Called by the book, holding the lock of the changed side.
+	void levelChanged(bool buy_side, uint32_t price, uint32_t volume, uint32_t orders, bool created)
+	{
+		Side &side = sides[buy_side ? 0 : 1];
+		std::scoped_lock lock(side.mtx);
+		auto [it, inserted] = side.dirty.try_emplace(price, LevelDelta{volume, orders, !created});
+		if (!inserted)
+		{
+			it->second.volume = volume;
+			it->second.orders = orders;
+		}
+		dirty.store(true, std::memory_order_release);
+	}
+
+	// Publisher side: swaps out the changes of a side for an empty map.
+	void take(bool buy_side, std::unordered_map<uint32_t, LevelDelta> &into)
+	{
+		Side &side = sides[buy_side ? 0 : 1];
+		std::scoped_lock lock(side.mtx);
+		into.swap(side.dirty);
+	}
+
+	// Publisher side: puts back a change that could not be sent. A newer change
+	// to the same level wins, but consumers still do not know what they were never sent.
+	void restore(bool buy_side, uint32_t price, const LevelDelta &delta)
+	{
+		Side &side = sides[buy_side ? 0 : 1];
+		std::scoped_lock lock(side.mtx);
+		auto [it, inserted] = side.dirty.try_emplace(price, delta);
+		if (!inserted)
+			it->second.existed = delta.existed;
+		dirty.store(true, std::memory_order_release);
+	}
+
+	bool takeDirty() { return dirty.exchange(false, std::memory_order_acq_rel); }
+
+	uint64_t sequence = 0; // last sequence number published for the book, publisher thread only
+
+private:
+	struct Side
+	{
+		ProfiledMutex<LockClass::LevelFeed> mtx;
+		std::unordered_map<uint32_t, LevelDelta> dirty;
+	};
+
+	Side sides[2]; // bids, asks
+	std::atomic<bool> dirty{false};
+};
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef LOCK_PROFILE_HPP
+#define LOCK_PROFILE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+#ifdef LOCK_PROFILING
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "PerThread.hpp"
+#include "Timestamp.hpp"
+#endif
+
+/*
+ * Every mutex the engine takes while processing commands belongs to a class,
+ * so a profiling build (make LOCK_PROFILE=1) can report where threads wait.
+ */
+enum class LockClass
+{
+	Book,        // OrderBook::mtx, taken to lock both sides in order
+	BookSide,    // BuyBook::mtx / SellBook::mtx
+	OrderMap,    // a FlatHashMap segment
+	HashBucket,  // a ConcurrentHashMap bucket, writers only
+	MapResize,   // starting and finishing a ConcurrentHashMap resize
+	ObjectPool,  // an ObjectPool's shared free list
+	Instruments, // creating a book in the InstrumentDirectory
+	Snapshot,    // publishing a PublishedSnapshot
+	LevelFeed,   // a LevelFeed side
+	Output,      // synchronous output
+	Count
+};
+
+#ifndef LOCK_PROFILING
+
+// Without LOCK_PROFILING every ProfiledMutex is a plain std::mutex and the profiler does nothing.
+template <LockClass>
+using ProfiledMutex = std::mutex;
+
+struct LockProfiler
+{
+	static constexpr bool enabled = false;
+
+	static void label(std::mutex &, uint64_t, const char *) {}
+	static void attributeLevel(uint64_t, bool, uint32_t) {}
+	static void report(FILE *) {}
+};
+
+#else
+
+// Counts of one lock class on one thread, or of one labelled lock. Written by
+// one thread at a time (the owner of the counts, or whoever holds the lock),
+// read by the report at any time.
+struct LockCounts
+{
+	std::atomic<uint64_t> acquisitions{0};
+	std::atomic<uint64_t> contended{0};
+	std::atomic<uint64_t> wait_ns{0};
+
+	void add(bool waited, uint64_t ns)
+	{
+		acquisitions.store(acquisitions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (!waited)
+			return;
+		contended.store(contended.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		wait_ns.store(wait_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+	}
+};
+
+// A lock reported on its own, e.g. the locks of one book.
+struct LockSite
+{
+	uint64_t symbol; // packed, see packSymbol
+	const char *what;
+	LockCounts counts;
+	LockSite *next = nullptr;
+};
+
+/*
+ * LockProfiler adds up how often each class of lock is taken, how often a
+ * thread had to wait for it and for how long, per thread (see PerThread), and
+ * ranks them in report(). Labelled locks are also counted on their own, and
+ * waits for the side locks of a book are attributed to the price level of the
+ * command that waited, to find the hot instruments and levels.
+ */
+class LockProfiler
+{
+public:
+	static constexpr bool enabled = true;
+
+	// Counts mtx on its own from now on. Call before the lock is shared.
+	template <typename Mutex>
+	static void label(Mutex &mtx, uint64_t symbol, const char *what)
+	{
+		LockSite *site = new LockSite{symbol, what, {}, nullptr}; // never freed, outlives its lock
+		std::scoped_lock lock(sites_mtx);
+		site->next = sites;
+		sites = site;
+		mtx.site = site;
+	}
+
+	static void acquired(LockClass lock_class, bool side, bool waited, uint64_t ns)
+	{
+		Storage *storage = PerThread<Storage>::tryLocal();
+		if (storage)
+			storage->classes[static_cast<size_t>(lock_class)].add(waited, ns);
+		if (side && waited)
+		{
+			++pending_contended;
+			pending_wait_ns += ns;
+		}
+	}
+
+	// Attributes the waits for side locks since the previous call to a price level.
+	static void attributeLevel(uint64_t symbol, bool buy_side, uint32_t price)
+	{
+		if (pending_contended == 0)
+			return;
+		Storage *storage = PerThread<Storage>::tryLocal();
+		if (storage)
+		{
+			std::scoped_lock lock(storage->levels_mtx);
+			LevelCounts &counts = storage->levels[LevelKey{symbol, price, buy_side}];
+			counts.contended += pending_contended;
+			counts.wait_ns += pending_wait_ns;
+		}
+		pending_contended = 0;
+		pending_wait_ns = 0;
+	}
+
+	// Writes the lock classes, then the labelled locks and the price levels
+	// with the longest waits, ranked by total wait.
+	static void report(FILE *out)
+	{
+		static const char *names[] = {"book", "book side", "order map", "hash bucket", "map resize",
+		                              "object pool", "instruments", "snapshot", "level feed", "output"};
+
+		struct Line
+		{
+			std::string name;
+			uint64_t acquisitions;
+			uint64_t contended;
+			uint64_t wait_ns;
+		};
+		auto print = [out](const char *title, std::vector<Line> &lines, size_t limit)
+		{
+			std::sort(lines.begin(), lines.end(), [](const Line &a, const Line &b)
+			{
+				return a.wait_ns != b.wait_ns ? a.wait_ns > b.wait_ns : a.acquisitions > b.acquisitions;
+			});
+			fprintf(out, "%-24s %14s %12s %7s %12s %10s\n", title, "acquisitions", "contended", "%", "wait ms", "avg ns");
+			for (size_t i = 0; i < lines.size() && i < limit; ++i)
+			{
+				const Line &line = lines[i];
+				if (line.acquisitions == 0 && line.contended == 0)
+					break;
+				char acquisitions[24] = "-";
+				char percent[16] = "-";
+				if (line.acquisitions)
+				{
+					snprintf(acquisitions, sizeof(acquisitions), "%llu", (unsigned long long)line.acquisitions);
+					snprintf(percent, sizeof(percent), "%.2f", 100.0 * static_cast<double>(line.contended) / static_cast<double>(line.acquisitions));
+				}
+				fprintf(out, "%-24s %14s %12llu %7s %12.3f %10llu\n", line.name.c_str(), acquisitions,
+				        (unsigned long long)line.contended, percent, static_cast<double>(line.wait_ns) / 1e6,
+				        (unsigned long long)(line.contended ? line.wait_ns / line.contended : 0));
+			}
+		};
+
+		std::vector<Line> classes;
+		for (size_t c = 0; c < static_cast<size_t>(LockClass::Count); ++c)
+			classes.push_back(Line{names[c], 0, 0, 0});
+		std::unordered_map<LevelKey, LevelCounts, LevelHash> levels;
+		PerThread<Storage>::forEach([&](const Storage &storage)
+		{
+			for (size_t c = 0; c < static_cast<size_t>(LockClass::Count); ++c)
+			{
+				classes[c].acquisitions += storage.classes[c].acquisitions.load(std::memory_order_relaxed);
+				classes[c].contended += storage.classes[c].contended.load(std::memory_order_relaxed);
+				classes[c].wait_ns += storage.classes[c].wait_ns.load(std::memory_order_relaxed);
+			}
+			std::scoped_lock lock(storage.levels_mtx);
+			for (const auto &[key, counts] : storage.levels)
+			{
+				levels[key].contended += counts.contended;
+				levels[key].wait_ns += counts.wait_ns;
+			}
+		});
+		print("lock class", classes, classes.size());
+
+		std::vector<Line> hot_sites;
+		{
+			std::scoped_lock lock(sites_mtx);
+			for (LockSite *site = sites; site; site = site->next)
+			{
+				hot_sites.push_back(Line{symbolName(site->symbol) + " " + site->what,
+				                         site->counts.acquisitions.load(std::memory_order_relaxed),
+				                         site->counts.contended.load(std::memory_order_relaxed),
+				                         site->counts.wait_ns.load(std::memory_order_relaxed)});
+			}
+		}
+		fprintf(out, "\n");
+		print("instrument lock", hot_sites, LOCK_REPORT_TOP);
+
+		// only contended acquisitions are attributed to levels
+		std::vector<Line> hot_levels;
+		for (const auto &[key, counts] : levels)
+		{
+			hot_levels.push_back(Line{symbolName(key.symbol) + (key.buy_side ? " B " : " S ") + std::to_string(key.price),
+			                          0, counts.contended, counts.wait_ns});
+		}
+		fprintf(out, "\n");
+		print("price level (order side)", hot_levels, LOCK_REPORT_TOP);
+		fflush(out);
+	}
+
+private:
+	static constexpr size_t LOCK_REPORT_TOP = 10;
+
+	struct LevelKey
+	{
+		uint64_t symbol;
+		uint32_t price;
+		bool buy_side;
+
+		bool operator==(const LevelKey &other) const = default;
+	};
+
+	struct LevelHash
+	{
+		size_t operator()(const LevelKey &key) const
+		{
+			return std::hash<uint64_t>{}(key.symbol * 0x9e3779b97f4a7c15ULL ^ (uint64_t(key.price) << 1 | key.buy_side));
+		}
+	};
+
+	struct LevelCounts
+	{
+		uint64_t contended = 0;
+		uint64_t wait_ns = 0;
+	};
+
+	struct Storage
+	{
+		LockCounts classes[static_cast<size_t>(LockClass::Count)];
+		mutable std::mutex levels_mtx; // only contended by report()
+		std::unordered_map<LevelKey, LevelCounts, LevelHash> levels;
+	};
+
+	static std::string symbolName(uint64_t packed)
+	{
+		std::string name;
+		for (; packed; packed >>= 8)
+			name += static_cast<char>(packed & 0xff);
+		return name;
+	}
+
+	static inline std::mutex sites_mtx;
+	static inline LockSite *sites = nullptr; // guarded by sites_mtx
+	static inline thread_local uint64_t pending_contended = 0;
+	static inline thread_local uint64_t pending_wait_ns = 0;
+};
+
+/*
+ * CountingMutex is a std::mutex that tells LockProfiler about every lock():
+ * an uncontended acquisition costs a try_lock and a few counter updates, a
+ * contended one also two timestamps around the wait.
+ */
+template <LockClass Class>
+class CountingMutex
+{
+public:
+	CountingMutex() = default;
+	CountingMutex(const CountingMutex &) = delete;
+	CountingMutex &operator=(const CountingMutex &) = delete;
+
+	void lock()
+	{
+		if (mtx.try_lock())
+		{
+			acquired(false, 0);
+			return;
+		}
+		int64_t start = Timestamp::now();
+		mtx.lock();
+		acquired(true, static_cast<uint64_t>(Timestamp::now() - start));
+	}
+
+	bool try_lock()
+	{
+		if (!mtx.try_lock())
+			return false;
+		acquired(false, 0);
+		return true;
+	}
+
+	void unlock() { mtx.unlock(); }
+
+private:
+	friend class LockProfiler;
+
+	std::mutex mtx;
+	LockSite *site = nullptr;
+
+	// called holding mtx
+	void acquired(bool waited, uint64_t ns)
+	{
+		if (site)
+			site->counts.add(waited, ns);
+		LockProfiler::acquired(Class, Class == LockClass::BookSide, waited, ns);
+	}
+};
+
+template <LockClass Class>
+using ProfiledMutex = CountingMutex<Class>;
+
+#endif
+
+#endif
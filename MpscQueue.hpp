@@ -0,0 +1,118 @@
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+constexpr int MPSC_POLL_SPINS = 2000; // empty polls before the consumer goes to sleep
+
+/*
+ * MpscQueue is a bounded lock-free queue with many producers and one consumer.
+ * Each cell carries a sequence number telling whether it is free for the
+ * producer that claimed its position or ready for the consumer. Producers
+ * claim positions with a CAS on tail; the consumer owns head outright.
+ * Producers yield while the queue is full, and the consumer spins for a while
+ * on an empty queue before sleeping on an atomic wait.
+ */
+template <typename T>
+class MpscQueue
+{
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	const size_t mask;
+	alignas(64) std::atomic<size_t> tail;
+	alignas(64) size_t head;
+	alignas(64) std::atomic<uint32_t> sleeping;
+
+public:
+	// capacity must be a power of two
+	explicit MpscQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1), tail(0), head(0), sleeping(0)
+	{
+		for (size_t i = 0; i < capacity; ++i)
+		{
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	MpscQueue(const MpscQueue &) = delete;
+	MpscQueue &operator=(const MpscQueue &) = delete;
+
+	void push(const T &value)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+		Cell *cell;
+		while (true)
+		{
+			cell = &cells[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (diff == 0)
+			{
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				// full, wait for the consumer to catch up
+				std::this_thread::yield();
+				pos = tail.load(std::memory_order_relaxed);
+			}
+			else
+			{
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->value = value;
+		// seq_cst store/load pairs with pop(): either the consumer sees this
+		// cell, or we see it asleep
+		cell->sequence.store(pos + 1, std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_seq_cst))
+		{
+			sleeping.store(0, std::memory_order_relaxed);
+			sleeping.notify_one();
+		}
+	}
+
+	bool tryPop(T &value)
+	{
+		Cell &cell = cells[head & mask];
+		if (cell.sequence.load(std::memory_order_seq_cst) != head + 1)
+			return false;
+
+		value = cell.value;
+		cell.sequence.store(head + mask + 1, std::memory_order_release);
+		++head;
+		return true;
+	}
+
+	// Blocks until a value is available.
+	void pop(T &value)
+	{
+		for (int spins = 0; !tryPop(value); ++spins)
+		{
+			if (spins < MPSC_POLL_SPINS)
+				continue;
+
+			sleeping.store(1, std::memory_order_seq_cst);
+			if (tryPop(value))
+			{
+				sleeping.store(0, std::memory_order_relaxed);
+				return;
+			}
+			sleeping.wait(1, std::memory_order_seq_cst);
+			spins = 0;
+		}
+	}
+};
+
+#endif
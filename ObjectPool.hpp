@@ -0,0 +1,199 @@
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "LockProfile.hpp"
+
+constexpr size_t POOL_SLAB_OBJECTS = 256; // objects carved from each slab
+constexpr size_t POOL_CACHE_MAX = 4096;   // free objects a thread keeps before spilling half of them
+constexpr int64_t POOL_STATS_BATCH = 64;  // local allocations before the shared counters are updated
+
+struct PoolStats
+{
+	size_t object_size;
+	size_t capacity;    // objects carved from slabs so far
+	int64_t in_use;     // live objects
+	int64_t high_water; // most live objects seen at once
+};
+
+/*
+ * ObjectPool<T> is a slab allocator with a free list per thread.
+ * create() and destroy() only touch the calling thread's cache; the shared
+ * free list is used to refill an empty cache and to take back the surplus of
+ * threads that free more than they allocate (e.g. fills of orders created by
+ * another connection). Slabs are never returned to the system, so memory stays
+ * with the pool for the lifetime of the process instead of fragmenting the heap.
+ * in_use and high_water are updated every POOL_STATS_BATCH operations per
+ * thread, so they can lag by that much per thread.
+ */
+template <typename T>
+class ObjectPool
+{
+private:
+	union Slot
+	{
+		Slot *next;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	struct Shared
+	{
+		ProfiledMutex<LockClass::ObjectPool> mtx;
+		Slot *free_list = nullptr;
+		std::atomic<size_t> capacity{0};
+		std::atomic<int64_t> in_use{0};
+		std::atomic<int64_t> high_water{0};
+	};
+
+	struct Cache
+	{
+		Slot *free_list = nullptr;
+		size_t free_count = 0;
+		int64_t pending = 0; // change of in_use not yet added to the shared counter
+
+		~Cache()
+		{
+			flushStats(*this);
+			if (!free_list)
+				return;
+
+			Slot *last = free_list;
+			while (last->next)
+				last = last->next;
+
+			Shared &pool = shared();
+			std::scoped_lock lock(pool.mtx);
+			last->next = pool.free_list;
+			pool.free_list = free_list;
+		}
+	};
+
+	// never destroyed: detached threads may still allocate while the process exits
+	static Shared &shared()
+	{
+		static Shared *pool = new Shared();
+		return *pool;
+	}
+
+	static Cache &cache()
+	{
+		thread_local Cache local;
+		return local;
+	}
+
+	static void flushStats(Cache &local)
+	{
+		Shared &pool = shared();
+		int64_t now = pool.in_use.fetch_add(local.pending, std::memory_order_relaxed) + local.pending;
+		local.pending = 0;
+
+		int64_t seen = pool.high_water.load(std::memory_order_relaxed);
+		while (now > seen && !pool.high_water.compare_exchange_weak(seen, now, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	static void refill(Cache &local)
+	{
+		Shared &pool = shared();
+		std::scoped_lock lock(pool.mtx);
+
+		if (!pool.free_list)
+		{
+			Slot *slab = new Slot[POOL_SLAB_OBJECTS];
+			for (size_t i = 0; i + 1 < POOL_SLAB_OBJECTS; ++i)
+				slab[i].next = &slab[i + 1];
+			slab[POOL_SLAB_OBJECTS - 1].next = nullptr;
+
+			pool.free_list = slab;
+			pool.capacity.fetch_add(POOL_SLAB_OBJECTS, std::memory_order_relaxed);
+		}
+
+		// take up to a slab's worth of objects
+		Slot *last = pool.free_list;
+		size_t taken = 1;
+		while (taken < POOL_SLAB_OBJECTS && last->next)
+		{
+			last = last->next;
+			++taken;
+		}
+
+		local.free_list = pool.free_list;
+		pool.free_list = last->next;
+		last->next = nullptr;
+		local.free_count = taken;
+	}
+
+	static void spill(Cache &local)
+	{
+		Slot *first = local.free_list;
+		Slot *last = first;
+		for (size_t i = 1; i < POOL_CACHE_MAX / 2; ++i)
+			last = last->next;
+
+		local.free_list = last->next;
+		local.free_count -= POOL_CACHE_MAX / 2;
+
+		Shared &pool = shared();
+		std::scoped_lock lock(pool.mtx);
+		last->next = pool.free_list;
+		pool.free_list = first;
+	}
+
+public:
+	template <typename... Args>
+	static T *create(Args &&...args)
+	{
+		Cache &local = cache();
+		if (!local.free_list)
+			refill(local);
+
+		Slot *slot = local.free_list;
+		local.free_list = slot->next;
+		--local.free_count;
+
+		if (++local.pending >= POOL_STATS_BATCH)
+			flushStats(local);
+
+		return new (slot->storage) T(std::forward<Args>(args)...);
+	}
+
+	static void destroy(T *object)
+	{
+		if (!object)
+			return;
+
+		object->~T();
+		Slot *slot = reinterpret_cast<Slot *>(object);
+
+		Cache &local = cache();
+		slot->next = local.free_list;
+		local.free_list = slot;
+		++local.free_count;
+
+		if (--local.pending <= -POOL_STATS_BATCH)
+			flushStats(local);
+
+		if (local.free_count > POOL_CACHE_MAX)
+			spill(local);
+	}
+
+	static PoolStats stats()
+	{
+		Shared &pool = shared();
+		return PoolStats{
+			sizeof(T),
+			pool.capacity.load(std::memory_order_relaxed),
+			pool.in_use.load(std::memory_order_relaxed),
+			pool.high_water.load(std::memory_order_relaxed),
+		};
+	}
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef PER_THREAD_HPP
+#define PER_THREAD_HPP
+
+#include <mutex>
+
+/*
+ * PerThread<T> gives every thread its own T, created on first use, and lets
+ * any thread visit all of them. The T of a thread that exits is handed to the
+ * next new thread rather than freed, so what it recorded is kept and memory
+ * stays bounded by the number of live threads. There is one set of Ts per
+ * type T; wrap T in a struct of its own for a separate set.
+ */
+template <typename T>
+class PerThread
+{
+public:
+	static T &local()
+	{
+		static thread_local Owner owner;
+		if (!owner.slot)
+		{
+			std::scoped_lock lock(registry_mtx);
+			for (Slot *slot = registry; slot && !owner.slot; slot = slot->next)
+			{
+				if (!slot->owned)
+				{
+					slot->owned = true;
+					owner.slot = slot;
+				}
+			}
+			if (!owner.slot)
+			{
+				owner.slot = new Slot();
+				owner.slot->next = registry;
+				registry = owner.slot;
+			}
+		}
+		return owner.slot->value;
+	}
+
+	// As local(), but nullptr once the thread is exiting and its T has been
+	// handed back, for callers that may run in other thread_local destructors.
+	static T *tryLocal() { return exited ? nullptr : &local(); }
+
+	// Calls visit(const T&) for every T, live or waiting for a new thread.
+	// Their owners may be writing to them at the same time.
+	template <typename Visit>
+	static void forEach(Visit visit)
+	{
+		std::scoped_lock lock(registry_mtx);
+		for (Slot *slot = registry; slot; slot = slot->next)
+			visit(static_cast<const T &>(slot->value));
+	}
+
+private:
+	struct Slot
+	{
+		T value;
+		bool owned = true; // guarded by registry_mtx
+		Slot *next = nullptr;
+	};
+
+	struct Owner
+	{
+		Slot *slot = nullptr;
+
+		~Owner()
+		{
+			exited = true;
+			if (slot)
+			{
+				std::scoped_lock lock(registry_mtx);
+				slot->owned = false;
+			}
+		}
+	};
+
+	static inline thread_local bool exited = false;
+
+	static inline std::mutex registry_mtx;
+	static inline Slot *registry = nullptr; // never freed, guarded by registry_mtx
+};
+
+#endif
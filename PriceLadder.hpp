@@ -0,0 +1,327 @@
+#ifndef PRICE_LADDER_HPP
+#define PRICE_LADDER_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "ObjectPool.hpp"
+
+constexpr size_t LADDER_INITIAL_TICKS = 1024;  // must be a power of two
+constexpr size_t LADDER_MAX_TICKS = 1 << 16;    // 512KB of slots per side at most
+
+/*
+ * PriceLadder holds the price levels of one side of an order book.
+ * Levels live in a dense window of slots indexed by (price - base), with a bitmap
+ * of occupied slots, so the best price, the insertion point and the next level
+ * are found by array indexing and bit-scans instead of walking a list.
+ * The window is rebased when the side empties and grows (up to LADDER_MAX_TICKS)
+ * to cover new prices. Levels that still do not fit go to a sorted overflow map.
+ * A Fenwick tree over the window slots keeps cumulative volume by price, so the
+ * volume available up to a price is an O(log n) query; level volumes must only
+ * be changed through addVolume() to keep it in step.
+ * The ladder is not synchronised: callers must hold the lock of its side.
+ */
+template <typename Level>
+class PriceLadder
+{
+private:
+	bool descending; // buy side: best level is the highest price
+	int64_t base;    // price of slot 0
+	std::vector<Level *> slots;
+	std::vector<uint64_t> occupied;
+	std::map<uint32_t, Level *> overflow;
+	Level *best_level;
+	size_t window_count;
+	std::vector<uint64_t> depth; // Fenwick tree of level volume over the window slots, 1-based
+	uint64_t window_volume;
+
+	int64_t windowEnd() const { return base + static_cast<int64_t>(slots.size()); }
+	bool inWindow(int64_t price) const { return price >= base && price < windowEnd(); }
+
+	bool isBetter(uint32_t a, uint32_t b) const { return descending ? a > b : a < b; }
+
+	// first occupied slot at or above index, or -1
+	int64_t scanUp(int64_t index) const
+	{
+		size_t word = static_cast<size_t>(index) >> 6;
+		if (word >= occupied.size())
+			return -1;
+
+		uint64_t bits = occupied[word] & (~0ULL << (index & 63));
+		while (true)
+		{
+			if (bits)
+				return static_cast<int64_t>((word << 6) + std::countr_zero(bits));
+			if (++word == occupied.size())
+				return -1;
+			bits = occupied[word];
+		}
+	}
+
+	// last occupied slot at or below index, or -1
+	int64_t scanDown(int64_t index) const
+	{
+		if (index < 0)
+			return -1;
+
+		size_t word = static_cast<size_t>(index) >> 6;
+		uint64_t bits = occupied[word] & (~0ULL >> (63 - (index & 63)));
+		while (true)
+		{
+			if (bits)
+				return static_cast<int64_t>((word << 6) + 63 - std::countl_zero(bits));
+			if (word-- == 0)
+				return -1;
+			bits = occupied[word];
+		}
+	}
+
+	// lowest level with price >= from
+	Level *lowestFrom(int64_t from) const
+	{
+		Level *found = nullptr;
+		if (window_count && from < windowEnd())
+		{
+			int64_t slot = scanUp(std::max(from, base) - base);
+			if (slot >= 0)
+				found = slots[slot];
+		}
+		if (!overflow.empty() && from <= UINT32_MAX)
+		{
+			auto it = overflow.lower_bound(static_cast<uint32_t>(std::max<int64_t>(from, 0)));
+			if (it != overflow.end() && (!found || it->first < found->price))
+				found = it->second;
+		}
+		return found;
+	}
+
+	// highest level with price <= from
+	Level *highestFrom(int64_t from) const
+	{
+		Level *found = nullptr;
+		if (window_count && from >= base)
+		{
+			int64_t slot = scanDown(std::min(from, windowEnd() - 1) - base);
+			if (slot >= 0)
+				found = slots[slot];
+		}
+		if (!overflow.empty() && from >= 0)
+		{
+			auto it = overflow.upper_bound(static_cast<uint32_t>(std::min<int64_t>(from, UINT32_MAX)));
+			if (it != overflow.begin() && (!found || std::prev(it)->first > found->price))
+				found = std::prev(it)->second;
+		}
+		return found;
+	}
+
+	void depthAdd(size_t slot, int64_t delta)
+	{
+		for (size_t i = slot + 1; i < depth.size(); i += i & (~i + 1))
+			depth[i] += static_cast<uint64_t>(delta);
+		window_volume += static_cast<uint64_t>(delta);
+	}
+
+	// volume of window slots [0, slot]
+	uint64_t depthPrefix(size_t slot) const
+	{
+		uint64_t volume = 0;
+		for (size_t i = slot + 1; i > 0; i -= i & (~i + 1))
+			volume += depth[i];
+		return volume;
+	}
+
+	// builds the tree from the levels in the window in O(n)
+	void rebuildDepth()
+	{
+		std::fill(depth.begin(), depth.end(), 0);
+		window_volume = 0;
+		for (size_t word = 0; word < occupied.size(); ++word)
+		{
+			for (uint64_t bits = occupied[word]; bits; bits &= bits - 1)
+			{
+				size_t slot = (word << 6) + std::countr_zero(bits);
+				depth[slot + 1] = slots[slot]->total_volume;
+				window_volume += slots[slot]->total_volume;
+			}
+		}
+		for (size_t i = 1; i < depth.size(); ++i)
+		{
+			size_t parent = i + (i & (~i + 1));
+			if (parent < depth.size())
+				depth[parent] += depth[i];
+		}
+	}
+
+	void place(Level *level)
+	{
+		size_t slot = level->price - base;
+		slots[slot] = level;
+		occupied[slot >> 6] |= 1ULL << (slot & 63);
+		++window_count;
+	}
+
+	// Rebuilds the window with the given size so that it covers [lo, hi], then
+	// pulls in any overflow levels that now fit.
+	void relayout(int64_t lo, int64_t hi, size_t ticks)
+	{
+		std::vector<Level *> old_slots(ticks, nullptr);
+		std::vector<uint64_t> old_occupied(ticks / 64, 0);
+		old_slots.swap(slots);
+		old_occupied.swap(occupied);
+
+		int64_t span = hi - lo + 1;
+		base = lo - (static_cast<int64_t>(ticks) - span) / 2;
+		base = std::clamp<int64_t>(base, 0, (int64_t{1} << 32) - static_cast<int64_t>(ticks));
+		window_count = 0;
+
+		for (size_t word = 0; word < old_occupied.size(); ++word)
+		{
+			for (uint64_t bits = old_occupied[word]; bits; bits &= bits - 1)
+			{
+				place(old_slots[(word << 6) + std::countr_zero(bits)]);
+			}
+		}
+
+		for (auto it = overflow.lower_bound(static_cast<uint32_t>(base)); it != overflow.end() && inWindow(it->first);)
+		{
+			place(it->second);
+			it = overflow.erase(it);
+		}
+
+		depth.assign(ticks + 1, 0);
+		rebuildDepth();
+	}
+
+	// Tries to move the window so that it includes price, growing it if needed.
+	void cover(uint32_t price)
+	{
+		if (window_count == 0)
+		{
+			relayout(price, price, slots.size());
+			return;
+		}
+
+		int64_t lo = std::min<int64_t>(price, base + scanUp(0));
+		int64_t hi = std::max<int64_t>(price, base + scanDown(static_cast<int64_t>(slots.size()) - 1));
+		size_t span = static_cast<size_t>(hi - lo + 1);
+		if (span > LADDER_MAX_TICKS)
+			return;
+
+		size_t ticks = slots.size();
+		while (ticks < LADDER_MAX_TICKS && ticks < span * 2)
+			ticks *= 2;
+		relayout(lo, hi, ticks);
+	}
+
+public:
+	explicit PriceLadder(bool descending)
+		: descending(descending), base(0), slots(LADDER_INITIAL_TICKS, nullptr),
+		  occupied(LADDER_INITIAL_TICKS / 64, 0), overflow(), best_level(nullptr), window_count(0),
+		  depth(LADDER_INITIAL_TICKS + 1, 0), window_volume(0) {}
+
+	~PriceLadder()
+	{
+		for (auto *level : slots)
+			ObjectPool<Level>::destroy(level);
+		for (auto &entry : overflow)
+			ObjectPool<Level>::destroy(entry.second);
+	}
+
+	PriceLadder(const PriceLadder &) = delete;
+	PriceLadder(PriceLadder &&) = delete;
+	PriceLadder &operator=(const PriceLadder &) = delete;
+	PriceLadder &operator=(PriceLadder &&) = delete;
+
+	bool empty() const { return best_level == nullptr; }
+
+	Level *best() const { return best_level; }
+
+	// the next level after this one in priority order, or nullptr
+	Level *next(const Level *level) const
+	{
+		return descending ? highestFrom(static_cast<int64_t>(level->price) - 1)
+		                  : lowestFrom(static_cast<int64_t>(level->price) + 1);
+	}
+
+	Level *find(uint32_t price) const
+	{
+		if (inWindow(price))
+			return slots[price - base];
+
+		auto it = overflow.find(price);
+		return it == overflow.end() ? nullptr : it->second;
+	}
+
+	// Creates the level for price, which must not exist yet.
+	Level *add(uint32_t price)
+	{
+		if (!inWindow(price))
+			cover(price);
+
+		Level *level = ObjectPool<Level>::create(price);
+		if (inWindow(price))
+			place(level);
+		else
+			overflow.emplace(price, level);
+
+		if (!best_level || isBetter(price, best_level->price))
+			best_level = level;
+		return level;
+	}
+
+	// Changes the volume of a level by delta, keeping the depth index in step.
+	void addVolume(Level *level, int64_t delta)
+	{
+		level->total_volume += static_cast<decltype(level->total_volume)>(delta);
+		if (inWindow(level->price))
+			depthAdd(level->price - base, delta);
+	}
+
+	// Total volume of the levels priced at or better than price.
+	uint64_t volumeThrough(uint32_t price) const
+	{
+		uint64_t volume = 0;
+		if (descending)
+		{
+			if (price < windowEnd())
+				volume += price > base ? window_volume - depthPrefix(price - 1 - base) : window_volume;
+			for (auto it = overflow.lower_bound(price); it != overflow.end(); ++it)
+				volume += it->second->total_volume;
+		}
+		else
+		{
+			if (price >= base)
+				volume += depthPrefix(std::min<int64_t>(price, windowEnd() - 1) - base);
+			for (auto it = overflow.begin(); it != overflow.end() && it->first <= price; ++it)
+				volume += it->second->total_volume;
+		}
+		return volume;
+	}
+
+	// Unlinks a level and returns it to the pool.
+	void remove(Level *level)
+	{
+		if (level == best_level)
+			best_level = next(level);
+
+		if (inWindow(level->price))
+		{
+			size_t slot = level->price - base;
+			if (level->total_volume)
+				depthAdd(slot, -static_cast<int64_t>(level->total_volume));
+			slots[slot] = nullptr;
+			occupied[slot >> 6] &= ~(1ULL << (slot & 63));
+			--window_count;
+		}
+		else
+		{
+			overflow.erase(level->price);
+		}
+		ObjectPool<Level>::destroy(level);
+	}
+};
+
+#endif
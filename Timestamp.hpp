@@ -0,0 +1,135 @@
+#ifndef TIMESTAMP_HPP
+#define TIMESTAMP_HPP
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TIMESTAMP_HAVE_TSC 1
+#else
+#define TIMESTAMP_HAVE_TSC 0
+#endif
+
+constexpr std::chrono::milliseconds TIMESTAMP_CALIBRATION{20}; // how long init() watches both clocks
+
+enum class ClockSource
+{
+	Steady, // std::chrono::steady_clock
+	Tsc     // the CPU's invariant time stamp counter, calibrated against steady_clock
+};
+
+/*
+ * Timestamp is the clock output timestamps are taken from, in nanoseconds on
+ * the steady_clock timeline whichever source is used.
+ * The TSC source reads the time stamp counter and scales it with a rate
+ * measured against steady_clock at startup, which avoids a clock_gettime per
+ * event. It is only used if the CPU reports an invariant TSC.
+ * With per-command timestamps, a CommandTimestamp pins one reading for a whole
+ * matching pass, so a sweep through many resting orders reads the clock once.
+ * init() and setPerCommand() must be called before any other thread reads the clock.
+ */
+class Timestamp
+{
+public:
+	// Returns the source actually in use.
+	static ClockSource init(ClockSource wanted)
+	{
+		source = ClockSource::Steady;
+		if (wanted == ClockSource::Tsc && tscAvailable())
+		{
+			calibrate();
+			source = ClockSource::Tsc;
+		}
+		return source;
+	}
+
+	static void setPerCommand(bool enabled) { per_command = enabled; }
+
+	static ClockSource clockSource() { return source; }
+
+	static int64_t now() noexcept
+	{
+#if TIMESTAMP_HAVE_TSC
+		if (source == ClockSource::Tsc)
+		{
+			// signed, another core's TSC may be slightly behind base_tsc
+			int64_t ticks = static_cast<int64_t>(__rdtsc() - base_tsc);
+			return base_ns + static_cast<int64_t>(static_cast<double>(ticks) * ns_per_tick);
+		}
+#endif
+		return steadyNow();
+	}
+
+	// The pinned timestamp of the current command, if any, or now().
+	static int64_t current() noexcept
+	{
+		return pinned ? pinned : now();
+	}
+
+	static int64_t steadyNow() noexcept
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static bool tscAvailable()
+	{
+#if TIMESTAMP_HAVE_TSC
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+			return false;
+		return edx & (1u << 8); // invariant TSC
+#else
+		return false;
+#endif
+	}
+
+private:
+	friend class CommandTimestamp;
+
+	static inline ClockSource source = ClockSource::Steady;
+	static inline bool per_command = false;
+	static inline uint64_t base_tsc = 0;
+	static inline int64_t base_ns = 0;
+	static inline double ns_per_tick = 1.0;
+	static inline thread_local int64_t pinned = 0;
+
+	static void calibrate()
+	{
+#if TIMESTAMP_HAVE_TSC
+		int64_t start_ns = steadyNow();
+		uint64_t start_tsc = __rdtsc();
+		int64_t end_ns;
+		while ((end_ns = steadyNow()) - start_ns < std::chrono::nanoseconds(TIMESTAMP_CALIBRATION).count())
+		{
+		}
+		uint64_t end_tsc = __rdtsc();
+
+		ns_per_tick = static_cast<double>(end_ns - start_ns) / static_cast<double>(end_tsc - start_tsc);
+		base_tsc = end_tsc;
+		base_ns = end_ns;
+#endif
+	}
+};
+
+/*
+ * CommandTimestamp pins Timestamp::current() to a single reading while it is
+ * in scope, if per-command timestamps are enabled.
+ */
+class CommandTimestamp
+{
+public:
+	CommandTimestamp()
+	{
+		if (Timestamp::per_command)
+			Timestamp::pinned = Timestamp::now();
+	}
+
+	~CommandTimestamp() { Timestamp::pinned = 0; }
+
+	CommandTimestamp(const CommandTimestamp &) = delete;
+	CommandTimestamp &operator=(const CommandTimestamp &) = delete;
+};
+
+#endif
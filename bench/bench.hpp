@@ -0,0 +1,52 @@
+// Helpers shared by the benchmarks. Every measurement is printed as one line
+// of key=value fields, the last of which is the measured value, e.g.
+//
+//   bench=hashmap map=flat threads=4 keys=100000 writes=10 mops=21.37
+//
+// so that `make bench` output from two commits can be lined up by
+// bench/compare.py.
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <cstdio>
+#include <string>
+
+// Makes the compiler assume value is read, so the work that computed it is not optimised away.
+template <typename T>
+inline void doNotOptimize(const T &value)
+{
+	asm volatile("" : : "r"(&value) : "memory");
+}
+
+class BenchLine
+{
+public:
+	explicit BenchLine(const char *bench) : text("bench=") { text += bench; }
+
+	BenchLine &operator()(const char *key, const char *value)
+	{
+		text += ' ';
+		text += key;
+		text += '=';
+		text += value;
+		return *this;
+	}
+
+	BenchLine &operator()(const char *key, unsigned long long value)
+	{
+		return (*this)(key, std::to_string(value).c_str());
+	}
+
+	// Prints the line, ending with the measured metric.
+	void print(const char *metric, double value)
+	{
+		printf("%s %s=%.2f\n", text.c_str(), metric, value);
+		fflush(stdout);
+	}
+
+private:
+	std::string text;
+};
+
+#endif
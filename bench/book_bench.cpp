@@ -0,0 +1,208 @@
+// Benchmarks OrderBook on its own, without I/O: adding resting orders
+// (processNewOrder -> addRestingOrder), sweeping levels (matchBuyOrder) and a
+// mix of adds and cancels (cancelOrder) from several threads, on a book
+// prefilled to a given depth (levels per side) and occupancy (orders per level).
+// Output is muted, so the numbers are the cost of the book itself.
+//
+// Usage: book_bench [max threads]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "../engine.hpp"
+
+constexpr uint32_t BASE_PRICE = 100000; // buys rest below it, sells at or above it
+constexpr uint32_t ORDER_COUNT = 10;
+constexpr size_t ADDS = 200000;
+constexpr size_t FILLS = 200000;
+constexpr size_t MIXED_OPS_PER_THREAD = 200000;
+
+static std::atomic<uint32_t> next_order_id{1};
+
+static ClientCommand order(CommandType type, uint32_t order_id, uint32_t price, uint32_t count)
+{
+	ClientCommand input{};
+	input.type = type;
+	input.order_id = order_id;
+	input.price = price;
+	input.count = count;
+	std::memcpy(input.instrument, "BENCH", 6);
+	return input;
+}
+
+static uint32_t levelPrice(CommandType side, uint32_t level)
+{
+	return side == input_buy ? BASE_PRICE - 1 - level : BASE_PRICE + level;
+}
+
+// Rests depth levels of occupancy orders on one side, returns their ids.
+static std::vector<uint32_t> prefill(OrderBook &book, CommandType side, uint32_t depth, uint32_t occupancy)
+{
+	std::vector<uint32_t> ids;
+	for (uint32_t level = 0; level < depth; ++level)
+	{
+		for (uint32_t i = 0; i < occupancy; ++i)
+		{
+			uint32_t id = next_order_id.fetch_add(1, std::memory_order_relaxed);
+			book.processNewOrder(order(side, id, levelPrice(side, level), ORDER_COUNT));
+			ids.push_back(id);
+		}
+	}
+	return ids;
+}
+
+static std::unique_ptr<OrderBook> newBook()
+{
+	return std::make_unique<OrderBook>(0, packSymbol("BENCH"), false);
+}
+
+// orders of earlier runs are gone with their books
+static void reset()
+{
+	Engine::orders_hashmap.clear();
+}
+
+// ns per resting order added at a random one of the existing levels
+static double runAdd(uint32_t depth, uint32_t occupancy)
+{
+	auto book = newBook();
+	prefill(*book, input_buy, depth, occupancy);
+
+	std::mt19937 rng(1);
+	std::vector<ClientCommand> adds;
+	for (size_t i = 0; i < ADDS; ++i)
+		adds.push_back(order(input_buy, next_order_id.fetch_add(1, std::memory_order_relaxed), levelPrice(input_buy, rng() % depth), ORDER_COUNT));
+
+	auto start = std::chrono::steady_clock::now();
+	for (const ClientCommand &input : adds)
+		book->processNewOrder(input);
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	book.reset();
+	reset();
+	return ns / ADDS;
+}
+
+// ns per resting order filled by buys that sweep every level of a refilled sell side
+static double runSweep(uint32_t depth, uint32_t occupancy)
+{
+	auto book = newBook();
+	double ns = 0;
+	size_t fills = 0;
+	while (fills < FILLS)
+	{
+		prefill(*book, input_sell, depth, occupancy);
+		ClientCommand sweep = order(input_buy, next_order_id.fetch_add(1, std::memory_order_relaxed), levelPrice(input_sell, depth - 1), depth * occupancy * ORDER_COUNT);
+
+		auto start = std::chrono::steady_clock::now();
+		book->processNewOrder(sweep);
+		ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		fills += depth * occupancy;
+	}
+
+	book.reset();
+	reset();
+	return ns / static_cast<double>(fills);
+}
+
+/*
+ * Mops/s over all threads of adds and cancels. cancel_percent of the operations
+ * cancel one of the thread's resting orders, the others add one at a random
+ * level. Threads alternate sides, so two threads on a shared book take
+ * different side locks.
+ */
+static double runMixed(size_t threads, bool shared, uint32_t depth, uint32_t occupancy, unsigned cancel_percent)
+{
+	std::vector<std::unique_ptr<OrderBook>> books;
+	for (size_t t = 0; t < (shared ? 1 : threads); ++t)
+		books.push_back(newBook());
+
+	std::vector<std::vector<uint32_t>> resting(threads);
+	for (size_t t = 0; t < threads; ++t)
+	{
+		CommandType side = t % 2 ? input_sell : input_buy;
+		resting[t] = prefill(*books[shared ? 0 : t], side, depth, occupancy);
+	}
+
+	std::atomic<bool> go{false};
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < threads; ++t)
+	{
+		workers.emplace_back([&, t]
+		{
+			OrderBook &book = *books[shared ? 0 : t];
+			CommandType side = t % 2 ? input_sell : input_buy;
+			std::vector<uint32_t> &ids = resting[t];
+			std::mt19937 rng(static_cast<unsigned>(t + 1));
+			while (!go.load(std::memory_order_acquire))
+				;
+
+			for (size_t i = 0; i < MIXED_OPS_PER_THREAD; ++i)
+			{
+				if (!ids.empty() && rng() % 100 < cancel_percent)
+				{
+					size_t victim = rng() % ids.size();
+					book.cancelOrder(ids[victim], side);
+					ids[victim] = ids.back();
+					ids.pop_back();
+				}
+				else
+				{
+					uint32_t id = next_order_id.fetch_add(1, std::memory_order_relaxed);
+					book.processNewOrder(order(side, id, levelPrice(side, rng() % depth), ORDER_COUNT));
+					ids.push_back(id);
+				}
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for (auto &worker : workers)
+		worker.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	books.clear();
+	reset();
+	return static_cast<double>(threads * MIXED_OPS_PER_THREAD) / seconds / 1e6;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t max_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+
+	Timestamp::init(ClockSource::Steady);
+	Output::muted = true;
+
+	for (uint32_t depth : {1u, 16u, 256u})
+	{
+		for (uint32_t occupancy : {1u, 16u})
+		{
+			BenchLine("book_add")("depth", depth)("occupancy", occupancy).print("ns", runAdd(depth, occupancy));
+			BenchLine("book_sweep")("depth", depth)("occupancy", occupancy).print("ns", runSweep(depth, occupancy));
+		}
+	}
+
+	for (unsigned cancels : {10u, 50u, 90u})
+	{
+		for (size_t threads = 1; threads <= max_threads; threads *= 2)
+		{
+			for (bool shared : {false, true})
+			{
+				if (shared && threads == 1)
+					continue;
+				BenchLine("book_mixed")("threads", threads)("books", shared ? "shared" : "own")("depth", 16ull)("occupancy", 16ull)("cancels", cancels)
+				    .print("mops", runMixed(threads, shared, 16, 16, cancels));
+			}
+		}
+	}
+	return 0;
+}
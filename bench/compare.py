@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+# Lines up two `make bench` outputs (bench_output.txt) by their parameters and
+# prints the change of each measurement.
+#
+# Usage: bench/compare.py <before> <after>
+import sys
+
+
+def load(path):
+    results = {}
+    for line in open(path):
+        fields = line.split()
+        if not fields or not all('=' in field for field in fields):
+            continue
+        metric, value = fields[-1].split('=', 1)
+        results[(' '.join(fields[:-1]), metric)] = float(value)
+    return results
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: compare.py <before> <after>')
+    before, after = load(sys.argv[1]), load(sys.argv[2])
+    width = max((len(name) for name, _ in before.keys() | after.keys()), default=0)
+    for name, metric in sorted(before.keys() | after.keys()):
+        old, new = before.get((name, metric)), after.get((name, metric))
+        if old is None or new is None:
+            print(f'{name:<{width}}  {metric:>4}  {"-" if old is None else old:>10}  {"-" if new is None else new:>10}')
+            continue
+        change = (new - old) / old * 100 if old else 0.0
+        # lower is better for times, higher for rates
+        better = change < 0 if metric == 'ns' else change > 0
+        print(f'{name:<{width}}  {metric:>4}  {old:>10.2f}  {new:>10.2f}  {change:+7.1f}%{"" if abs(change) < 5 else (" better" if better else " worse")}')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,228 @@
+// Contention benchmark for the order id maps: threads run a mix of finds and
+// insert/erase pairs on one shared map, for several map sizes. SharedMutexMap
+// is the chained map as it was before lookups went optimistic (one
+// shared_mutex per bucket), sized like ConcurrentHashMap ends up after
+// growing, so only the read path differs.
+// A single HashBucket is also measured on its own, by chain length.
+//
+// Usage: hashmap_bench [max threads]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "bench.hpp"
+#include "../ConcurrentHashMap.hpp"
+#include "../FlatHashMap.hpp"
+
+constexpr size_t OPS_PER_THREAD = 1000000;
+constexpr size_t BUCKET_OPS = 2000000;
+
+struct Value
+{
+	void *book;
+	uint32_t side;
+	void *order;
+};
+
+class SharedMutexMap
+{
+private:
+	struct Node
+	{
+		uint32_t key;
+		Value value;
+		Node *next;
+	};
+
+	struct Bucket
+	{
+		Node *head = nullptr;
+		mutable std::shared_mutex mtx;
+	};
+
+	std::vector<Bucket> buckets;
+
+public:
+	explicit SharedMutexMap(size_t keys) : buckets(sizeFor(keys)) {}
+
+	static size_t sizeFor(size_t keys)
+	{
+		size_t size = HASH_SIZE_DEFAULT;
+		while (keys > size * HASH_MAX_LOAD)
+			size *= 2;
+		return size;
+	}
+
+	~SharedMutexMap()
+	{
+		for (auto &bucket : buckets)
+		{
+			while (bucket.head)
+			{
+				Node *node = bucket.head;
+				bucket.head = node->next;
+				delete node;
+			}
+		}
+	}
+
+	bool find(uint32_t key, Value &value) const
+	{
+		const Bucket &bucket = buckets[key % buckets.size()];
+		std::shared_lock lock(bucket.mtx);
+		for (Node *node = bucket.head; node; node = node->next)
+		{
+			if (node->key == key)
+			{
+				value = node->value;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void insert(uint32_t key, const Value &value)
+	{
+		Bucket &bucket = buckets[key % buckets.size()];
+		std::unique_lock lock(bucket.mtx);
+		for (Node *node = bucket.head; node; node = node->next)
+		{
+			if (node->key == key)
+			{
+				node->value = value;
+				return;
+			}
+		}
+		bucket.head = new Node{key, value, bucket.head};
+	}
+
+	void erase(uint32_t key)
+	{
+		Bucket &bucket = buckets[key % buckets.size()];
+		std::unique_lock lock(bucket.mtx);
+		for (Node **link = &bucket.head; *link; link = &(*link)->next)
+		{
+			if ((*link)->key == key)
+			{
+				Node *node = *link;
+				*link = node->next;
+				delete node;
+				return;
+			}
+		}
+	}
+};
+
+template <typename Map>
+static Map makeMap(uint32_t keys)
+{
+	if constexpr (std::is_same_v<Map, SharedMutexMap>)
+		return Map(keys);
+	else
+		return Map();
+}
+
+// Mops/s over all threads; write_percent of the operations are an erase and re-insert of a key
+template <typename Map>
+static double run(size_t threads, uint32_t keys, unsigned write_percent)
+{
+	Map map = makeMap<Map>(keys);
+	for (uint32_t key = 0; key < keys; ++key)
+		map.insert(key, Value{nullptr, key, nullptr});
+
+	std::vector<std::thread> workers;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t t = 0; t < threads; ++t)
+	{
+		workers.emplace_back([&map, t, keys, write_percent]
+		{
+			std::mt19937 rng(static_cast<unsigned>(t + 1));
+			size_t found = 0;
+			for (size_t i = 0; i < OPS_PER_THREAD; ++i)
+			{
+				uint32_t key = rng() % keys;
+				if (rng() % 100 < write_percent)
+				{
+					map.erase(key);
+					map.insert(key, Value{nullptr, key, nullptr});
+				}
+				else
+				{
+					Value value{};
+					found += map.find(key, value);
+				}
+			}
+			doNotOptimize(found);
+		});
+	}
+	for (auto &worker : workers)
+		worker.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return static_cast<double>(threads * OPS_PER_THREAD) / seconds / 1e6;
+}
+
+// ns per operation on one bucket holding chain nodes, looking up (or replacing) the last one
+static double runBucket(size_t chain, bool write)
+{
+	HashBucket<uint32_t, Value> bucket;
+	bool moved;
+	for (uint32_t key = 0; key < chain; ++key)
+		bucket.insert(key, Value{nullptr, key, nullptr}, moved);
+
+	uint32_t last = 0;
+	size_t found = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < BUCKET_OPS; ++i)
+	{
+		// replaced nodes are retired, which needs a guard
+		Epoch::Guard guard;
+		if (write)
+		{
+			bucket.insert(last, Value{nullptr, static_cast<uint32_t>(i), nullptr}, moved);
+		}
+		else
+		{
+			Value value{};
+			found += bucket.find(last, value, moved);
+		}
+	}
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	doNotOptimize(found);
+	return ns / BUCKET_OPS;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t max_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+
+	for (uint32_t keys : {10000u, 100000u, 1000000u})
+	{
+		for (unsigned writes : {0u, 10u, 50u})
+		{
+			for (size_t threads = 1; threads <= max_threads; threads *= 2)
+			{
+				auto line = [&](const char *map)
+				{
+					return BenchLine("hashmap")("map", map)("threads", threads)("keys", keys)("writes", writes);
+				};
+				line("shared_mutex").print("mops", run<SharedMutexMap>(threads, keys, writes));
+				line("seqlock").print("mops", run<ConcurrentHashMap<uint32_t, Value>>(threads, keys, writes));
+				line("flat").print("mops", run<FlatHashMap<uint32_t, Value>>(threads, keys, writes));
+			}
+		}
+	}
+
+	for (size_t chain : {1u, 4u, 16u})
+	{
+		BenchLine("bucket")("op", "find")("chain", chain).print("ns", runBucket(chain, false));
+		BenchLine("bucket")("op", "replace")("chain", chain).print("ns", runBucket(chain, true));
+	}
+	return 0;
+}
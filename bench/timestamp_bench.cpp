@@ -0,0 +1,60 @@
+// Measures the cost of a timestamp from each clock source and how far the
+// calibrated TSC clock drifts from steady_clock.
+//
+// Usage: timestamp_bench [seconds of drift sampling]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "bench.hpp"
+#include "../Timestamp.hpp"
+
+constexpr int CALLS = 10000000;
+
+template <typename Read>
+static double nsPerCall(Read read)
+{
+	int64_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < CALLS; ++i)
+		sink += read();
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	// keep the reads from being optimised away
+	doNotOptimize(sink);
+	return elapsed / CALLS;
+}
+
+int main(int argc, char* argv[])
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : 2;
+
+	Timestamp::init(ClockSource::Steady);
+	BenchLine("timestamp")("clock", "steady").print("ns", nsPerCall([] { return Timestamp::now(); }));
+
+	Timestamp::setPerCommand(true);
+	{
+		CommandTimestamp pin;
+		BenchLine("timestamp")("clock", "pinned").print("ns", nsPerCall([] { return Timestamp::current(); }));
+	}
+
+	if(Timestamp::init(ClockSource::Tsc) != ClockSource::Tsc)
+	{
+		fprintf(stderr, "tsc unavailable\n");
+		return 0;
+	}
+	BenchLine("timestamp")("clock", "tsc").print("ns", nsPerCall([] { return Timestamp::now(); }));
+
+	// drift: tsc minus steady_clock, sampled every 100ms
+	for (int i = 0; i <= seconds * 10; ++i)
+	{
+		int64_t steady = Timestamp::steadyNow();
+		int64_t tsc = Timestamp::now();
+		if (i % 10 == 0)
+			BenchLine("timestamp_drift")("seconds", static_cast<unsigned long long>(i / 10)).print("ns", static_cast<double>(tsc - steady));
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+	return 0;
+}
@@ -17,6 +17,7 @@
 #define INPUT_CANCEL_ORDER 'C'
 #define INPUT_BUY_ORDER 'B'
 #define INPUT_SELL_ORDER 'S'
+#define INPUT_AMEND_ORDER 'A'
 
 static char* line_buffer;
 static size_t line_buffer_size = 0;
@@ -104,6 +105,14 @@ int main(int argc, char* argv[])
 					return 1;
 				}
 				break;
+			case INPUT_AMEND_ORDER:
+				input.type = input_amend;
+				if(sscanf(line_buffer + 1, " %u %u %u", &input.order_id, &input.price, &input.count) != 3)
+				{
+					fprintf(stderr, "Invalid amend order: %s\n", line_buffer);
+					return 1;
+				}
+				break;
 			case INPUT_BUY_ORDER: input.type = input_buy; goto new_order;
 			case INPUT_SELL_ORDER:
 				input.type = input_sell;
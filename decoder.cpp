@@ -0,0 +1,71 @@
+// Converts the engine's binary output (--format=binary) back to the text
+// format, reading records from stdin and writing lines to stdout.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "output.hpp"
+
+static char in_buffer[1 << 16];
+static char out_buffer[1 << 16];
+
+int main(int argc, char* argv[])
+{
+	(void) argv;
+	if(argc != 1)
+	{
+		fprintf(stderr, "Usage: %s < <binary output>\n", argv[0]);
+		return 1;
+	}
+
+	size_t in_size = 0;
+	size_t out_size = 0;
+	while(true)
+	{
+		ssize_t got = read(STDIN_FILENO, in_buffer + in_size, sizeof(in_buffer) - in_size);
+		if(got == -1)
+		{
+			perror("read");
+			return 1;
+		}
+		if(got == 0)
+			break;
+		in_size += static_cast<size_t>(got);
+
+		size_t pos = 0;
+		while(true)
+		{
+			OutputEvent event;
+			size_t record = decodeBinary(in_buffer + pos, in_size - pos, event);
+			if(record == 0)
+				break;
+			if(record == SIZE_MAX)
+			{
+				fprintf(stderr, "Malformed record\n");
+				return 1;
+			}
+			pos += record;
+
+			if(out_size + OUTPUT_LINE_MAX > sizeof(out_buffer))
+			{
+				fwrite(out_buffer, 1, out_size, stdout);
+				out_size = 0;
+			}
+			out_size += formatText(event, out_buffer + out_size);
+		}
+
+		memmove(in_buffer, in_buffer + pos, in_size - pos);
+		in_size -= pos;
+	}
+
+	fwrite(out_buffer, 1, out_size, stdout);
+	if(in_size != 0)
+	{
+		fprintf(stderr, "Truncated record at end of input\n");
+		return 1;
+	}
+	return 0;
+}
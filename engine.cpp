@@ -4,9 +4,26 @@
 
 #include "io.hpp"
 #include "engine.hpp"
+#include "journal.hpp"
+#include "snapshot.hpp"
 #include "ConcurrentHashMap.hpp"
 
-ConcurrentHashMap<uint32_t, std::shared_ptr<Order>> Engine::orders_hashmap;
+OrderMap &Engine::orders_hashmap = *new OrderMap();
+
+Engine::Engine(EngineMode mode, size_t shard_count) : mode(mode), shards()
+{
+	if (mode != EngineMode::Sharded)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < shard_count; ++i)
+	{
+		shards.push_back(std::make_unique<Shard>());
+		shards.back()->thread = std::thread(&Engine::shard_thread, this, shards.back().get());
+		shards.back()->thread.detach();
+	}
+}
 
 void Engine::accept(ClientConnection connection)
 {
@@ -16,21 +33,50 @@ void Engine::accept(ClientConnection connection)
 
 void Engine::connection_thread(ClientConnection connection)
 {
+	ClientSession session;
 	while (true)
 	{
-		ClientCommand input{};
-		switch (connection.readInput(input))
+		std::span<const ClientCommand> batch;
+		int64_t read_start = LatencyStats::clock();
+		switch (connection.readBatch(batch))
 		{
 		case ReadResult::Error:
+		case ReadResult::WouldBlock:
 			SyncCerr{} << "Error reading input" << std::endl;
+			[[fallthrough]];
 		case ReadResult::EndOfFile:
+			// shards may still be working on our commands
+			drain(session);
 			return;
 		case ReadResult::Success:
 			break;
 		}
+		LatencyStats::recordReadSince(read_start);
+
+		dispatch(batch, session);
+	}
+}
+
+void Engine::dispatch(std::span<const ClientCommand> batch, ClientSession &session)
+{
+	if (mode == EngineMode::Locking)
+	{
+		processBatch(batch);
+		return;
+	}
+
+	for (const ClientCommand &input : batch)
+	{
+		dispatch(input, session);
+	}
+}
 
-		// Functions for printing output actions in the prescribed format are
-		// provided in the Output class:
+void Engine::dispatch(const ClientCommand &input, ClientSession &session)
+{
+	// Functions for printing output actions in the prescribed format are
+	// provided in the Output class:
+	if (mode == EngineMode::Locking)
+	{
 		switch (input.type)
 		{
 		case input_cancel:
@@ -40,6 +86,12 @@ void Engine::connection_thread(ClientConnection connection)
 			break;
 		}
 
+		case input_amend:
+		{
+			processAmendOrder(input);
+			break;
+		}
+
 		default:
 		{
 			//SyncCerr{} << "Got order: " << static_cast<char>(input.type) << " " << input.instrument << " x " << input.count << " @ " << input.price << " ID: " << input.order_id << std::endl;
@@ -47,400 +99,806 @@ void Engine::connection_thread(ClientConnection connection)
 			break;
 		}
 		}
+		return;
+	}
+
+	// the rest of the command is timed by its shard
+	int64_t lookup_start = LatencyStats::clock();
+	if (input.type == input_cancel || input.type == input_amend)
+	{
+		OrderHandle handle{};
+		bool found = orders_hashmap.find(input.order_id, handle);
+		LatencyStats::recordSince(LatencyStats::command(input.type), LatencyStage::Lookup, lookup_start);
+		if (!found)
+		{
+			// keep this output behind the ones of our earlier commands
+			drain(session);
+			rejectUnknown(input);
+			return;
+		}
+		submit(ShardCommand{input, handle.book, handle.side, &session}, session);
+		return;
+	}
+
+	// map the order to its book before queueing it, so that cancels can be routed to the same shard
+	OrderBook *order_book = findOrCreateBook(input.instrument);
+	orders_hashmap.insert(input.order_id, OrderHandle{order_book, input.type, nullptr});
+	LatencyStats::recordSince(LatencyStats::command(input.type), LatencyStage::Lookup, lookup_start);
+	submit(ShardCommand{input, order_book, input.type, &session}, session);
+}
+
+void Engine::submit(const ShardCommand &command, ClientSession &session)
+{
+	size_t shard = command.book->instrument_id % shards.size();
+
+	// commands queued on one shard run in order, but before moving on to
+	// another shard we wait for our commands on the previous one
+	if (session.shard != shard)
+	{
+		drain(session);
+		session.shard = shard;
+	}
+
+	++session.submitted;
+	shards[shard]->queue.push(command);
+}
+
+void Engine::drain(ClientSession &session)
+{
+	uint64_t completed;
+	while ((completed = session.completed.load(std::memory_order_acquire)) != session.submitted)
+	{
+		session.completed.wait(completed, std::memory_order_acquire);
+	}
+}
+
+void Engine::shard_thread(Shard *shard)
+{
+	while (true)
+	{
+		ShardCommand command;
+		shard->queue.pop(command);
+
+		if (command.capture)
+		{
+			command.book->capture(*command.capture);
+		}
+		else if (command.input.type == input_cancel)
+		{
+			CommandLatency latency(input_cancel);
+			command.book->cancelOrder(command.input.order_id, command.side);
+		}
+		else if (command.input.type == input_amend)
+		{
+			CommandLatency latency(input_amend);
+			command.book->amendOrder(command.input);
+		}
+		else
+		{
+			CommandLatency latency(command.input.type);
+			command.book->processNewOrder(command.input);
+		}
+
+		command.session->completed.fetch_add(1, std::memory_order_release);
+		command.session->completed.notify_all();
 	}
 }
 
+OrderBook *Engine::findOrCreateBook(const char *instrument)
+{
+	return findOrCreateBook(packSymbol(instrument));
+}
+
+OrderBook *Engine::findOrCreateBook(uint64_t symbol)
+{
+	return orderBooks.getOrCreate(symbol, [this](uint32_t instrument_id, uint64_t symbol)
+	{
+		//SyncCerr{} << "[DEBUG] Created new order book for instrument id: " << instrument_id << std::endl;
+		return new OrderBook(instrument_id, symbol, mode == EngineMode::Sharded);
+	});
+}
+
 void Engine::processNewOrder(const ClientCommand &input)
 {
-	//SyncCerr{} << "Processing new order: " << input.order_id << std::endl;
-	auto order = std::make_shared<Order>();
+	CommandLatency latency(input.type);
+	OrderBook *book = findOrCreateBook(input.instrument);
+	CommandLatency::mark(LatencyStage::Lookup);
+	book->processNewOrder(input);
+}
+
+void Engine::replay(const ClientCommand &input)
+{
+	if (input.type == input_cancel)
+	{
+		processCancelOrder(input);
+	}
+	else if (input.type == input_amend)
+	{
+		processAmendOrder(input);
+	}
+	else
+	{
+		processNewOrder(input);
+	}
+}
+
+Order *OrderBook::newOrder(const ClientCommand &input) const
+{
+	auto *order = ObjectPool<Order>::create();
 	order->type = input.type;
-	order->instrument = input.instrument;
+	order->instrument_id = instrument_id;
 	order->order_id = input.order_id;
 	order->price = input.price;
 	order->count = input.count;
+	return order;
+}
 
-	//SyncCerr{} << "[DEBUG] Inserting order " << input.order_id << " into orders_hashmap." << std::endl;
-	orders_hashmap.insert(order->order_id, order);
+void OrderBook::processNewOrder(const ClientCommand &input)
+{
+	//SyncCerr{} << "Processing new order: " << input.order_id << std::endl;
+	Order *order = newOrder(input);
 
-	OrderBook *order_book;
-	if (!orderBooks.find(order->instrument, order_book))
+	SideLock buy_lock;
+	SideLock sell_lock;
+	if (!single_writer)
 	{
-		order_book = new OrderBook(order->instrument);
-		orderBooks.insert(order->instrument, order_book);
-		//SyncCerr{} << "[DEBUG] Created new order book for instrument: " << order->instrument << std::endl;
+		// always lock in same order to avoid deadlock
+		std::unique_lock book_lock(mtx);
+		//SyncCerr{} << "[DEBUG] Locked book_lock" << std::endl;
+		buy_lock = SideLock(buy_book.mtx);
+		//SyncCerr{} << "[DEBUG] Locked buy_lock" << std::endl;
+		sell_lock = SideLock(sell_book.mtx);
+		//SyncCerr{} << "[DEBUG] Locked sell_lock" << std::endl;
+		LockProfiler::attributeLevel(symbol, input.type == input_buy, input.price);
 	}
 
-	// always lock in same order to avoid deadlock
-	std::unique_lock<std::mutex> book_lock(order_book->mtx);
-	//SyncCerr{} << "[DEBUG] Locked book_lock" << std::endl;
-	std::unique_lock<std::mutex> buy_lock(order_book->buy_book.head->mtx);
-	//SyncCerr{} << "[DEBUG] Locked buy_lock" << std::endl;
-    std::unique_lock<std::mutex> sell_lock(order_book->sell_book.head->mtx);
-	//SyncCerr{} << "[DEBUG] Locked sell_lock" << std::endl;
-	book_lock.unlock();
+	CommandLatency::mark(LatencyStage::Lock);
+	executeNewOrder(input, order, std::move(buy_lock), std::move(sell_lock));
+}
 
-	// Pre-scan the opposite side and lock if we have to add a resting order
+/*
+ * Matches and rests a new order. The caller holds the book: buy_lock and
+ * sell_lock are its side locks, released as soon as the order is done with
+ * them, or both empty when the book has a single writer or the caller keeps
+ * the sides locked itself.
+ */
+void OrderBook::executeNewOrder(const ClientCommand &input, Order *order, SideLock buy_lock, SideLock sell_lock)
+{
+	// taken once the book is ours, so pinned timestamps still follow the order of the output
+	CommandTimestamp command_time;
+
+	// journaled while the book is ours too, so the journal has its commands in the order they ran
+	if (Journal::enabled())
+	{
+		Journal::append(input);
+	}
+
+	if (placeOrder(order, std::move(buy_lock), std::move(sell_lock)))
+	{
+		return;
+	}
+
+	//SyncCerr{} << "[DEBUG] Finished processing new order " << order->order_id << std::endl;
+	// fully executed, the order never rested
+	if (single_writer)
+	{
+		// drop the mapping Engine::dispatch made while the order was queued
+		Engine::orders_hashmap.erase(order->order_id);
+	}
+	ObjectPool<Order>::destroy(order);
+}
+
+/*
+ * Matches an order against the opposite side and rests what is left of it.
+ * Returns whether it rested; if not, it is fully executed and the caller
+ * still owns it. The locks are as for executeNewOrder.
+ */
+bool OrderBook::placeOrder(Order *order, SideLock buy_lock, SideLock sell_lock)
+{
+	// Look up the crossing liquidity on the opposite side and keep our own side locked if we have to
+	// add a resting order. Nothing to release early when the locks are not ours to release.
+	uint64_t crossing_qty = 0;
 	if (order->type == input_buy)
 	{
-		//SyncCerr{} << "[DEBUG] Pre-scanning sell side for matching buy order " << order->order_id << std::endl;
-		auto remaining_qty = order->count;
-		PriceLevelNode *curr = order_book->sell_book.head->next;
-		
-		while (remaining_qty > 0 && curr)
+		if (buy_lock.owns_lock())
 		{
-			std::unique_lock<std::mutex> currLock(curr->mtx);
-			//SyncCerr{} << "[DEBUG] Checking sell PriceLevelNode with price " << curr->price << std::endl;
+			// liquidity on the sell side at or below our price
+			crossing_qty = sell_book.levels.volumeThrough(order->price);
 
-			// we can only match buy orders which have a higher price than sell
-			if (curr->price > order->price)
+			// we do not need to add as resting order (no need serialise), so we can unlock buy_lock
+			if (crossing_qty >= order->count)
 			{
-				//SyncCerr{} << "[DEBUG] Price level " << curr->price << " is too high for buy order price " << order->price << std::endl;
-				break;
+				buy_lock.unlock();
 			}
-			remaining_qty -= curr->total_volume;
-			//SyncCerr{} << "[DEBUG] Reduced remaining quantity to " << remaining_qty << " after checking price level " << curr->price << std::endl;
-			curr = curr->next;
-		}
-
-		// we do not need to add as resting order (no need serialise), so we can unlock buy_lock
-		if (remaining_qty <= 0)
-		{
-			buy_lock.unlock();
 		}
 
-		order_book->matchBuyOrder(order, std::move(sell_lock));
+		matchBuyOrder(order, std::move(sell_lock));
 
 		if (order->count > 0)
 		{
-			order_book->addRestingOrder(order, std::move(buy_lock));
+			addRestingOrder(order, std::move(buy_lock));
+			return true;
 		}
 	}
 	else
 	{
-		//SyncCerr{} << "[DEBUG] Pre-scanning buy side for matching sell order " << order->order_id << std::endl;
-		auto remaining_qty = order->count;
-		PriceLevelNode *curr = order_book->buy_book.head->next;
-
-		while (remaining_qty > 0 && curr)
+		if (sell_lock.owns_lock())
 		{
-			std::unique_lock<std::mutex> currLock(curr->mtx);
-			//SyncCerr{} << "[DEBUG] Checking buy PriceLevelNode with price " << curr->price << std::endl;
-			if (curr->price < order->price)
+			crossing_qty = buy_book.levels.volumeThrough(order->price);
+
+			if (crossing_qty >= order->count)
 			{
-				//SyncCerr{} << "[DEBUG] Price level " << curr->price << " is too low for sell order price " << order->price << std::endl;
-				break;
+				sell_lock.unlock();
 			}
-			remaining_qty -= curr->total_volume;
-			//SyncCerr{} << "[DEBUG] Reduced remaining quantity to " << remaining_qty << " after checking price level " << curr->price << std::endl;
-			curr = curr->next;
 		}
 
-		if (remaining_qty <= 0)
+		matchSellOrder(order, std::move(buy_lock));
+
+		if (order->count > 0)
 		{
-			sell_lock.unlock();
+			addRestingOrder(order, std::move(sell_lock));
+			return true;
 		}
+	}
+	return false;
+}
 
-		order_book->matchSellOrder(order, std::move(buy_lock));
+/*
+ * Fills active_order against the resting orders of one price level in FIFO order.
+ * Fully executed resting orders are removed from the level.
+ */
+static void fillAtLevel(Order *active_order, PriceLadder<PriceLevelNode> &levels, PriceLevelNode *level)
+{
+	while (level->head && active_order->count > 0)
+	{
+		Order *resting_order = level->head;
+		uint32_t transaction_qty = std::min(active_order->count, resting_order->count);
+		active_order->count -= transaction_qty;
+		resting_order->count -= transaction_qty;
+		levels.addVolume(level, -static_cast<int64_t>(transaction_qty));
+		resting_order->execution_id++;
 
-		if (order->count > 0)
+		auto output_time = getCurrentTimestamp();
+		Output::OrderExecuted(resting_order->order_id, active_order->order_id, resting_order->execution_id, level->price, transaction_qty, output_time);
+
+		// a partially executed resting order keeps its place
+		if (resting_order->count > 0)
 		{
-			order_book->addRestingOrder(order, std::move(sell_lock));
+			break;
 		}
+
+		level->unlink(resting_order);
+		Engine::orders_hashmap.erase(resting_order->order_id);
+		ObjectPool<Order>::destroy(resting_order);
 	}
-	//SyncCerr{} << "[DEBUG] Finished processing new order " << order->order_id << std::endl;
 }
 
 /*
  * Matches an active buy order against the sell side of the order book.
+ * sell_lock is held until matching is done.
  */
-void OrderBook::matchBuyOrder(std::shared_ptr<Order> active_order, std::unique_lock<std::mutex> sell_lock)
+void OrderBook::matchBuyOrder(Order *active_order, [[maybe_unused]] SideLock sell_lock)
 {
 	//SyncCerr{} << "[DEBUG] matchBuyOrder: Start matching for active buy order " << active_order->order_id << std::endl;
-	PriceLevelNode *dummy = sell_book.head;
-	std::unique_lock<std::mutex> prevLock = std::move(sell_lock);
-	PriceLevelNode *prev = dummy;
-	PriceLevelNode *curr = dummy->next;
-
-	while (curr && active_order->count > 0)
+	uint32_t initial_count = active_order->count;
+	while (active_order->count > 0)
 	{
-		std::unique_lock<std::mutex> currLock(curr->mtx);
-		//SyncCerr{} << "[DEBUG] matchBuyOrder: Checking PriceLevelNode with price " << curr->price << std::endl;
+		PriceLevelNode *curr = sell_book.levels.best();
 
-		// can match price
-		if (active_order->price >= curr->price)
+		// wont be able to match other prices
+		if (!curr || active_order->price < curr->price)
 		{
-			//SyncCerr{} << "[DEBUG] matchBuyOrder: Price match found. Active order price " << active_order->price << " >= current price " << curr->price << std::endl;
+			break;
+		}
 
-			for (auto it = curr->orders_list.begin(); it != curr->orders_list.end() && active_order->count > 0;)
-			{
-				std::shared_ptr<Order> resting_order = *it;
-				uint32_t transaction_qty = std::min(active_order->count, resting_order->count);
-				//SyncCerr{} << "[DEBUG] Executing trade: active order " << active_order->order_id << " resting order " << resting_order->order_id << " transaction qty " << transaction_qty << std::endl;
-				active_order->count -= transaction_qty;
-				resting_order->count -= transaction_qty;
-				curr->total_volume -= transaction_qty;
-				resting_order->execution_id++;
-
-				auto output_time = getCurrentTimestamp();
-				Output::OrderExecuted(resting_order->order_id, active_order->order_id, resting_order->execution_id, curr->price, transaction_qty, output_time);
-
-				// remove resting order if fully executed
-				if (resting_order->count == 0)
-				{
-					//SyncCerr{} << "[DEBUG] Resting order " << resting_order->order_id << " fully executed and removed." << std::endl;
-					it = curr->orders_list.erase(it);
-					Engine::orders_hashmap.erase(resting_order->order_id);
-				}
-				else
-				{
-					++it;
-				}
-			}
+		fillAtLevel(active_order, sell_book.levels, curr);
+		levelChanged(false, curr, false);
 
-			// remove PriceLevelNode if there are no more orders at this price level
-			if (curr->orders_list.empty())
-			{
-				//SyncCerr{} << "[DEBUG] PriceLevelNode with price " << curr->price << " is empty and will be removed." << std::endl;
-				prev->next = curr->next;
-				currLock.unlock();
-				delete curr;
-				curr = prev->next;
-				continue;
-			}
-		}
-		else
+		// remove PriceLevelNode if there are no more orders at this price level
+		if (curr->empty())
 		{
-			// wont be able to match other prices
-			//SyncCerr{} << "[DEBUG] matchBuyOrder: Active order price " << active_order->price << " is less than PriceLevelNode price " << curr->price << ". No further matches possible." << std::endl;
-			break;
+			sell_book.levels.remove(curr);
 		}
+	}
 
-		// continue to next PriceLevelNode
-		//SyncCerr{} << "[DEBUG] continuing to next PriceLevelNode" << std::endl;
-		prevLock.unlock();
-		prev = curr;
-		prevLock = std::move(currLock);
-		curr = curr->next;
+	if (active_order->count != initial_count)
+	{
+		publishSide(false);
 	}
 	//SyncCerr{} << "[DEBUG] matchBuyOrder: Finished matching for active buy order " << active_order->order_id << std::endl;
 }
 
 /*
  * Matches an active sell order against the buy side of the order book.
+ * buy_lock is held until matching is done.
  */
-void OrderBook::matchSellOrder(std::shared_ptr<Order> active_order, std::unique_lock<std::mutex> buy_lock)
+void OrderBook::matchSellOrder(Order *active_order, [[maybe_unused]] SideLock buy_lock)
 {
 	//SyncCerr{} << "[DEBUG] matchSellOrder: Start matching for active sell order " << active_order->order_id << std::endl;
-	PriceLevelNode *dummy = buy_book.head;
-	std::unique_lock<std::mutex> prevLock = std::move(buy_lock);
-	PriceLevelNode *prev = dummy;
-	PriceLevelNode *curr = dummy->next;
-
-	while (curr && active_order->count > 0)
+	uint32_t initial_count = active_order->count;
+	while (active_order->count > 0)
 	{
-		std::unique_lock<std::mutex> currLock(curr->mtx);
-		//SyncCerr{} << "[DEBUG] matchSellOrder: Checking PriceLevelNode with price " << curr->price << std::endl;
+		PriceLevelNode *curr = buy_book.levels.best();
 
-		if (active_order->price <= curr->price)
+		if (!curr || active_order->price > curr->price)
 		{
-			//SyncCerr{} << "[DEBUG] matchSellOrder: Price match found. Active order price " << active_order->price << " <= current price " << curr->price << std::endl;
+			break;
+		}
 
-			for (auto it = curr->orders_list.begin(); it != curr->orders_list.end() && active_order->count > 0;)
-			{
-				std::shared_ptr<Order> resting_order = *it;
-				uint32_t transaction_qty = std::min(active_order->count, resting_order->count);
-				//SyncCerr{} << "[DEBUG] Executing trade: active sell order " << active_order->order_id << " resting order " << resting_order->order_id << " transaction qty " << transaction_qty << std::endl;
+		fillAtLevel(active_order, buy_book.levels, curr);
+		levelChanged(true, curr, false);
+
+		if (curr->empty())
+		{
+			buy_book.levels.remove(curr);
+		}
+	}
+
+	if (active_order->count != initial_count)
+	{
+		publishSide(true);
+	}
+	//SyncCerr{} << "[DEBUG] matchSellOrder: Finished matching for active sell order " << active_order->order_id << std::endl;
+}
+
+/*
+ * Appends a resting order to its price level, creating the level if needed.
+ * side_lock must be the lock of the order's side.
+ */
+void OrderBook::addRestingOrder(Order *resting_order, [[maybe_unused]] SideLock side_lock)
+{
+	//SyncCerr{} << "[DEBUG] Adding resting order: " << resting_order->order_id << " to order book." << std::endl;
+	auto &levels = (resting_order->type == input_buy) ? buy_book.levels : sell_book.levels;
 
-				active_order->count -= transaction_qty;
-				resting_order->count -= transaction_qty;
-				curr->total_volume -= transaction_qty;
-				resting_order->execution_id++;
+	PriceLevelNode *level = levels.find(resting_order->price);
+	bool created = !level;
+	if (created)
+	{
+		level = levels.add(resting_order->price);
+	}
+	level->pushBack(resting_order);
+	levels.addVolume(level, resting_order->count);
+	levelChanged(resting_order->type == input_buy, level, created);
+	Engine::orders_hashmap.insert(resting_order->order_id, OrderHandle{this, resting_order->type, resting_order});
+	publishSide(resting_order->type == input_buy);
+
+	char name[9];
+	unpackSymbol(symbol, name);
+	auto output_time = getCurrentTimestamp();
+	Output::OrderAdded(resting_order->order_id, name, resting_order->price, resting_order->count, resting_order->type == input_sell, output_time);
+	//SyncCerr{} << "[DEBUG] Finished adding resting order " << resting_order->order_id << std::endl;
+}
 
-				auto output_time = getCurrentTimestamp();
-				Output::OrderExecuted(resting_order->order_id, active_order->order_id, resting_order->execution_id, curr->price, transaction_qty, output_time);
+void Engine::processCancelOrder(const ClientCommand &input)
+{
+	//SyncCerr{} << "[DEBUG] Begin processing cancel order for Order ID: " << input.order_id << std::endl;
+	CommandLatency latency(input_cancel);
+	OrderHandle handle{};
+	bool found = orders_hashmap.find(input.order_id, handle);
+	CommandLatency::mark(LatencyStage::Lookup);
+	if (!found)
+	{
+		//SyncCerr{} << "[DEBUG] Cancel order " << input.order_id << " not found in orders_hashmap." << std::endl;
+		rejectUnknown(input);
+		return;
+	}
+
+	handle.book->cancelOrder(input.order_id, handle.side);
+}
+
+void Engine::processAmendOrder(const ClientCommand &input)
+{
+	CommandLatency latency(input_amend);
+	OrderHandle handle{};
+	bool found = orders_hashmap.find(input.order_id, handle);
+	CommandLatency::mark(LatencyStage::Lookup);
+	if (!found)
+	{
+		rejectUnknown(input);
+		return;
+	}
 
-				if (resting_order->count == 0)
+	handle.book->amendOrder(input);
+}
+
+// Rejects a cancel or amend of an order that is not resting in any book.
+void Engine::rejectUnknown(const ClientCommand &input)
+{
+	auto output_time = getCurrentTimestamp();
+	if (input.type == input_amend)
+	{
+		Output::OrderAmended(input.order_id, false, input.price, input.count, output_time);
+	}
+	else
+	{
+		Output::OrderDeleted(input.order_id, false, output_time);
+	}
+}
+
+/*
+ * Runs a batch of one connection's commands in order, see OrderBook::processRun.
+ * Output is the same as dispatching them one by one.
+ */
+void Engine::processBatch(std::span<const ClientCommand> batch)
+{
+	while (!batch.empty())
+	{
+		const ClientCommand &input = batch.front();
+		int64_t lookup_start = LatencyStats::clock();
+		OrderBook *book;
+		if (input.type == input_cancel || input.type == input_amend)
+		{
+			OrderHandle handle{};
+			if (!orders_hashmap.find(input.order_id, handle))
+			{
+				if (input.type == input_cancel)
 				{
-					//SyncCerr{} << "[DEBUG] Resting order " << resting_order->order_id << " fully executed and removed." << std::endl;
-					it = curr->orders_list.erase(it);
-					Engine::orders_hashmap.erase(resting_order->order_id);
+					processCancelOrder(input);
 				}
 				else
 				{
-					++it;
+					processAmendOrder(input);
 				}
-			}
-
-			if (curr->orders_list.empty())
-			{
-				//SyncCerr{} << "[DEBUG] PriceLevelNode with price " << curr->price << " is empty and will be removed." << std::endl;
-				prev->next = curr->next;
-				currLock.unlock();
-				delete curr;
-				curr = prev->next;
+				batch = batch.subspan(1);
 				continue;
 			}
+			book = handle.book;
 		}
 		else
 		{
-			//SyncCerr{} << "[DEBUG] matchSellOrder: Active order price " << active_order->price << " is greater than PriceLevelNode price " << curr->price << ". No further matches possible." << std::endl;
-			break;
+			book = findOrCreateBook(input.instrument);
 		}
-
-		// continue to next PriceLevelNode
-		//SyncCerr{} << "[DEBUG] continuing to next PriceLevelNode" << std::endl;
-		prev = curr;
-		prevLock = std::move(currLock);
-		curr = curr->next;
+		LatencyStats::recordSince(LatencyStats::command(input.type), LatencyStage::Lookup, lookup_start);
+		batch = batch.subspan(book->processRun(batch));
 	}
-	//SyncCerr{} << "[DEBUG] matchSellOrder: Finished matching for active sell order " << active_order->order_id << std::endl;
 }
 
-void OrderBook::addRestingOrder(std::shared_ptr<Order> resting_order, std::unique_lock<std::mutex> dummy_lock)
+/*
+ * Runs the leading commands of a batch for this book, the first of which the
+ * caller found to be, under a single acquisition of its locks. The run goes on
+ * while the next command is a new order for the book's instrument or cancels
+ * or amends one of its orders, looked up once the commands before it have run. Both
+ * sides stay locked for the whole run. Returns how many commands ran.
+ */
+size_t OrderBook::processRun(std::span<const ClientCommand> commands)
 {
-	//SyncCerr{} << "[DEBUG] Adding resting order: " << resting_order->order_id << " to order book." << std::endl;
-	PriceLevelNode *dummy = (resting_order->type == input_buy) ? buy_book.head : sell_book.head;
-	std::unique_lock<std::mutex> prevLock = std::move(dummy_lock);
-	PriceLevelNode *prev = dummy;
-	PriceLevelNode *curr = dummy->next;
-
-	if (resting_order->type == input_buy)
+	SideLock buy_lock;
+	SideLock sell_lock;
+	size_t count = 0;
+	for (const ClientCommand &input : commands)
 	{
-		while (curr && curr->price > resting_order->price)
+		if (count > 0 && !inRun(input))
 		{
-			//SyncCerr{} << "[DEBUG] addRestingOrder (buy): Skipping PriceLevelNode with price " << curr->price << std::endl;
-			std::unique_lock<std::mutex> currLock(curr->mtx);
-			prevLock.unlock();
-			prev = curr;
-			prevLock = std::move(currLock);
-			curr = curr->next;
+			break;
 		}
-	}
-	else
-	{
-		while (curr && curr->price < resting_order->price)
+
+		CommandLatency latency(input.type);
+		if (count == 0)
+		{
+			if (!single_writer)
+			{
+				std::unique_lock book_lock(mtx);
+				buy_lock = SideLock(buy_book.mtx);
+				sell_lock = SideLock(sell_book.mtx);
+				if (input.type == input_buy || input.type == input_sell)
+				{
+					LockProfiler::attributeLevel(symbol, input.type == input_buy, input.price);
+				}
+			}
+			CommandLatency::mark(LatencyStage::Lock);
+		}
+
+		if (input.type == input_cancel)
 		{
-			//SyncCerr{} << "[DEBUG] addRestingOrder (sell): Skipping PriceLevelNode with price " << curr->price << std::endl;
-			std::unique_lock<std::mutex> currLock(curr->mtx);
-			prevLock.unlock();
-			prev = curr;
-			prevLock = std::move(currLock);
-			curr = curr->next;
+			executeCancel(input.order_id);
 		}
+		else if (input.type == input_amend)
+		{
+			executeAmend(input, SideLock(), SideLock());
+		}
+		else
+		{
+			executeNewOrder(input, newOrder(input), SideLock(), SideLock());
+		}
+		++count;
 	}
+	return count;
+}
 
-	// if there is an existing PriceLevelNode with the same price
-	if (curr && curr->price == resting_order->price)
+// Whether a command continues a run of this book. The caller holds the book.
+bool OrderBook::inRun(const ClientCommand &input) const
+{
+	if (input.type == input_buy || input.type == input_sell)
 	{
-		//SyncCerr{} << "[DEBUG] Found existing PriceLevelNode with matching price " << curr->price << ". Adding order to node." << std::endl;
-		curr->orders_list.push_back(resting_order);
-		curr->total_volume += resting_order->count;
+		return packSymbol(input.instrument) == symbol;
 	}
-	else
+	OrderHandle handle{};
+	return Engine::orders_hashmap.find(input.order_id, handle) && handle.book == this;
+}
+
+void OrderBook::cancelOrder(uint32_t order_id, CommandType side)
+{
+	//SyncCerr{} << "[DEBUG] Attempting to cancel order " << order_id << " from order book." << std::endl;
+	SideLock side_lock;
+	if (!single_writer)
 	{
-		//SyncCerr{} << "[DEBUG] Creating new PriceLevelNode for price " << resting_order->price << " with resting order " << resting_order->order_id << std::endl;
-		// create a new PriceLevelNode
-		PriceLevelNode *new_node = new PriceLevelNode(resting_order->price);
-		new_node->orders_list.push_back(resting_order);
-		new_node->total_volume = resting_order->count;
+		side_lock = SideLock(side == input_buy ? buy_book.mtx : sell_book.mtx);
+	}
+	CommandLatency::mark(LatencyStage::Lock);
+	executeCancel(order_id);
+}
+
+/*
+ * Cancels a resting order of this book, or rejects the cancel if it is no
+ * longer resting. The caller holds the lock of the order's side.
+ */
+void OrderBook::executeCancel(uint32_t order_id)
+{
+	CommandTimestamp command_time;
 
-		prev->next = new_node;
-		new_node->next = curr;
+	// the order may have been filled or cancelled since the caller looked it up,
+	// look again now that its side cannot change
+	OrderHandle handle{};
+	if (!Engine::orders_hashmap.find(order_id, handle) || !handle.order)
+	{
+		//SyncCerr{} << "[DEBUG] cancelOrder: Order " << order_id << " is no longer resting, cancel order fails" << std::endl;
+		auto output_time = getCurrentTimestamp();
+		Output::OrderDeleted(order_id, false, output_time);
+		return;
 	}
 
+	if (Journal::enabled())
+	{
+		ClientCommand cancel{input_cancel, order_id, 0, 0, {}};
+		unpackSymbol(symbol, cancel.instrument);
+		Journal::append(cancel);
+	}
+
+	bool is_buy = handle.side == input_buy;
+	Order *order = handle.order;
+	PriceLevelNode *level = order->level;
+	LockProfiler::attributeLevel(symbol, is_buy, level->price);
+	auto &levels = is_buy ? buy_book.levels : sell_book.levels;
+	level->unlink(order);
+	levels.addVolume(level, -static_cast<int64_t>(order->count));
+	levelChanged(is_buy, level, false);
+
+	// remove order from the orders hashmap
+	Engine::orders_hashmap.erase(order_id);
+
 	auto output_time = getCurrentTimestamp();
-	Output::OrderAdded(resting_order->order_id, resting_order->instrument.c_str(), resting_order->price, resting_order->count, resting_order->type == input_sell, output_time);
-	//SyncCerr{} << "[DEBUG] Finished adding resting order " << resting_order->order_id << std::endl;
+	Output::OrderDeleted(order_id, true, output_time);
+
+	// if there are no more orders at this price level, delete the PriceLevelNode
+	if (level->empty())
+	{
+		levels.remove(level);
+	}
+	publishSide(is_buy);
+	ObjectPool<Order>::destroy(order);
 }
 
-void Engine::processCancelOrder(const ClientCommand &input)
+void OrderBook::amendOrder(const ClientCommand &input)
 {
-	//SyncCerr{} << "[DEBUG] Begin processing cancel order for Order ID: " << input.order_id << std::endl;
-	std::shared_ptr<Order> cancellation_order;
-	if (!orders_hashmap.find(input.order_id, cancellation_order))
+	// a re-queued order may match, so lock the book as for a new order
+	SideLock buy_lock;
+	SideLock sell_lock;
+	if (!single_writer)
+	{
+		std::unique_lock book_lock(mtx);
+		buy_lock = SideLock(buy_book.mtx);
+		sell_lock = SideLock(sell_book.mtx);
+	}
+	CommandLatency::mark(LatencyStage::Lock);
+	executeAmend(input, std::move(buy_lock), std::move(sell_lock));
+}
+
+/*
+ * Amends a resting order of this book to input's price and count, or rejects
+ * the amend if the order is no longer resting or the count is 0.
+ * Reducing the count at the same price keeps the order's place in its level.
+ * Any other amend takes the order out of its level and places it again as if
+ * new, so it may match and goes to the back of its new level; it keeps its id
+ * and its execution ids carry on. The locks are as for executeNewOrder.
+ */
+void OrderBook::executeAmend(const ClientCommand &input, SideLock buy_lock, SideLock sell_lock)
+{
+	CommandTimestamp command_time;
+
+	OrderHandle handle{};
+	if (input.count == 0 || !Engine::orders_hashmap.find(input.order_id, handle) || !handle.order)
 	{
-		//SyncCerr{} << "[DEBUG] Cancel order " << input.order_id << " not found in orders_hashmap." << std::endl;
 		auto output_time = getCurrentTimestamp();
-		Output::OrderDeleted(input.order_id, false, output_time);
+		Output::OrderAmended(input.order_id, false, input.price, input.count, output_time);
 		return;
 	}
 
-	OrderBook *order_book;
-	// if no orderbook exists
-	if (!orderBooks.find(cancellation_order->instrument, order_book))
+	if (Journal::enabled())
 	{
-		//SyncCerr{} << "[DEBUG] Order book for instrument " << cancellation_order->instrument << " not found during cancelation." << std::endl;
+		ClientCommand amend = input;
+		unpackSymbol(symbol, amend.instrument);
+		Journal::append(amend);
+	}
+
+	bool is_buy = handle.side == input_buy;
+	Order *order = handle.order;
+	PriceLevelNode *level = order->level;
+	LockProfiler::attributeLevel(symbol, is_buy, input.price);
+	auto &levels = is_buy ? buy_book.levels : sell_book.levels;
+
+	if (input.price == order->price && input.count <= order->count)
+	{
+		levels.addVolume(level, -static_cast<int64_t>(order->count - input.count));
+		order->count = input.count;
+		levelChanged(is_buy, level, false);
+		publishSide(is_buy);
+
 		auto output_time = getCurrentTimestamp();
-		Output::OrderDeleted(input.order_id, false, output_time);
+		Output::OrderAmended(order->order_id, true, order->price, order->count, output_time);
 		return;
 	}
 
-	//SyncCerr{} << "[DEBUG] Found order book for instrument " << cancellation_order->instrument << ". Proceeding with cancellation." << std::endl;
-	order_book->cancelOrder(cancellation_order);
+	level->unlink(order);
+	levels.addVolume(level, -static_cast<int64_t>(order->count));
+	levelChanged(is_buy, level, false);
+	if (level->empty())
+	{
+		levels.remove(level);
+	}
+	publishSide(is_buy);
+
+	auto output_time = getCurrentTimestamp();
+	Output::OrderAmended(order->order_id, true, input.price, input.count, output_time);
+
+	// placeOrder may unlock the order's side before matching, so unmap the order
+	// until it rests again: a cancel meanwhile finds no order and is rejected
+	Engine::orders_hashmap.insert(order->order_id, OrderHandle{this, handle.side, nullptr});
+	order->price = input.price;
+	order->count = input.count;
+	if (!placeOrder(order, std::move(buy_lock), std::move(sell_lock)))
+	{
+		Engine::orders_hashmap.erase(order->order_id);
+		ObjectPool<Order>::destroy(order);
+	}
 }
 
-void OrderBook::cancelOrder(std::shared_ptr<Order> order)
+/*
+ * Republishes the top levels of one side. The caller holds that side's lock.
+ */
+void OrderBook::publishSide(bool buy_side)
 {
-	//SyncCerr{} << "[DEBUG] Attempting to cancel order " << order->order_id << " from order book." << std::endl;
-	// Find the order in the order book
-	PriceLevelNode *dummy = (order->type == input_buy) ? buy_book.head : sell_book.head;
-
-	std::unique_lock<std::mutex> prevLock(dummy->mtx);
-	PriceLevelNode *prev = dummy;
-	PriceLevelNode *curr = dummy->next;
+	auto &levels = buy_side ? buy_book.levels : sell_book.levels;
+	DepthLevel top[BOOK_SNAPSHOT_DEPTH];
+	size_t count = 0;
+	for (auto *level = levels.best(); level && count < BOOK_SNAPSHOT_DEPTH; level = levels.next(level))
+	{
+		top[count++] = DepthLevel{level->price, level->total_volume, level->order_count};
+	}
+	snapshot.publish(buy_side, top, count, !single_writer);
+}
 
-	// traverse LL of PriceLevelNode using hand-over-hand locking
-	while (curr)
+/*
+ * Records a level change for the market-data feed, if there is one.
+ * The caller holds the lock of that side; call before an emptied level is removed.
+ */
+void OrderBook::levelChanged(bool buy_side, const PriceLevelNode *level, bool created)
+{
+	if (LevelFeed::enabled)
 	{
-		std::unique_lock<std::mutex> currLock(curr->mtx);
-		//SyncCerr{} << "[DEBUG] cancelOrder: Inspecting PriceLevelNode with price " << curr->price << std::endl;
+		feed.levelChanged(buy_side, level->price, level->total_volume, level->order_count, created);
+	}
+}
 
-		// found PriceLevelNode with the same price
-		if (curr->price == order->price)
-		{
-			auto it = std::find_if(curr->orders_list.begin(), curr->orders_list.end(), [&order](const std::shared_ptr<Order> &o)
-								   { return o->order_id == order->order_id; });
+void Engine::capture(OrderBook *book, std::vector<char> &out)
+{
+	if (mode == EngineMode::Sharded)
+	{
+		// only its shard may look at the book, in between two of its commands
+		ClientSession session;
+		ShardCommand command{};
+		command.book = book;
+		command.session = &session;
+		command.capture = &out;
+		submit(command, session);
+		drain(session);
+		return;
+	}
 
-			// order not found
-			if (it == curr->orders_list.end())
-			{
-				//SyncCerr{} << "[DEBUG] cancelOrder: Order " << order->order_id << " not found in PriceLevelNode." << std::endl;
-				auto output_time = getCurrentTimestamp();
-				Output::OrderDeleted(order->order_id, false, output_time);
-				return;
-			}
+	// same order as processNewOrder, so no command of the book is halfway through
+	std::unique_lock book_lock(book->mtx);
+	SideLock buy_lock(book->buy_book.mtx);
+	SideLock sell_lock(book->sell_book.mtx);
+	book_lock.unlock();
+	book->capture(out);
+}
 
-			//SyncCerr{} << "[DEBUG] cancelOrder: Found order " << order->order_id << ". Removing from PriceLevelNode." << std::endl;
-			// remove order from the orders vector
-			curr->orders_list.erase(it);
-			curr->total_volume -= order->count;
+const char *Engine::restore(const char *data, uint64_t &symbol, uint64_t &sequence)
+{
+	auto saved = snapshotGet<SnapshotBook>(data);
+	symbol = saved.symbol;
+	sequence = saved.sequence;
 
-			// remove order from the orders hashmap
-			Engine::orders_hashmap.erase(order->order_id);
+	OrderBook *book = findOrCreateBook(saved.symbol);
+	data = book->restoreSide(data, true, saved.bid_levels);
+	return book->restoreSide(data, false, saved.ask_levels);
+}
 
-			auto output_time = getCurrentTimestamp();
-			Output::OrderDeleted(order->order_id, true, output_time);
+void OrderBook::capture(std::vector<char> &out)
+{
+	SnapshotBook saved{symbol, Journal::sequence(), 0, 0};
+	size_t at = out.size();
+	snapshotPut(out, saved);
 
-			// if there are no more orders at this price level, delete the PriceLevelNode
-			if (curr->orders_list.empty())
+	for (bool buy_side : {true, false})
+	{
+		auto &levels = buy_side ? buy_book.levels : sell_book.levels;
+		uint32_t &level_count = buy_side ? saved.bid_levels : saved.ask_levels;
+		for (auto *level = levels.best(); level; level = levels.next(level))
+		{
+			snapshotPut(out, SnapshotLevel{level->price, level->order_count});
+			for (Order *order = level->head; order; order = order->next)
 			{
-				//SyncCerr{} << "[DEBUG] cancelOrder: PriceLevelNode with price " << curr->price << " is empty and will be deleted." << std::endl;
-				prev->next = curr->next;
-				currLock.unlock(); 
-				delete curr;
+				snapshotPut(out, SnapshotOrder{order->order_id, order->count, order->execution_id});
 			}
-			return;
+			++level_count;
 		}
+	}
+	std::memcpy(out.data() + at, &saved, sizeof(saved));
+}
 
-		// we cannot unlock earlier because we might need to delete current PriceLevelNode
-		prevLock.unlock();
-		prev = curr;
-		prevLock = std::move(currLock);
-		curr = curr->next;
+/*
+ * Nothing else runs yet, so no lock is taken.
+ */
+const char *OrderBook::restoreSide(const char *data, bool buy_side, uint32_t level_count)
+{
+	auto &levels = buy_side ? buy_book.levels : sell_book.levels;
+	for (uint32_t i = 0; i < level_count; ++i)
+	{
+		auto saved_level = snapshotGet<SnapshotLevel>(data);
+		PriceLevelNode *level = levels.add(saved_level.price);
+		for (uint32_t j = 0; j < saved_level.orders; ++j)
+		{
+			auto saved = snapshotGet<SnapshotOrder>(data);
+			auto *order = ObjectPool<Order>::create();
+			order->type = buy_side ? input_buy : input_sell;
+			order->instrument_id = instrument_id;
+			order->order_id = saved.order_id;
+			order->execution_id = saved.execution_id;
+			order->price = saved_level.price;
+			order->count = saved.count;
+			level->pushBack(order);
+			levels.addVolume(level, order->count);
+			Engine::orders_hashmap.insert(order->order_id, OrderHandle{this, order->type, order});
+		}
+		levelChanged(buy_side, level, true);
 	}
+	publishSide(buy_side);
+	return data;
+}
 
-	//SyncCerr{} << "[DEBUG] cancelOrder: PriceLevelNode with price " << order->price << " is not found, cancel order fails" << std::endl;
-	auto output_time = getCurrentTimestamp();
-	Output::OrderDeleted(order->order_id, false, output_time);
-}
\ No newline at end of file
+bool Engine::snapshot(const char *instrument, BookSnapshot &out) const
+{
+	OrderBook *book = orderBooks.find(packSymbol(instrument));
+	if (!book)
+	{
+		return false;
+	}
+	book->snapshot.read(out);
+	return true;
+}
+
+static void reportPool(const char *name, const PoolStats &stats)
+{
+	SyncCerr{} << "pool " << name
+			   << ": in_use " << stats.in_use
+			   << ", high_water " << stats.high_water
+			   << ", capacity " << stats.capacity
+			   << ", object_size " << stats.object_size << std::endl;
+}
+
+void Engine::reportPoolStats()
+{
+	reportPool("Order", ObjectPool<Order>::stats());
+	reportPool("PriceLevelNode", ObjectPool<PriceLevelNode>::stats());
+	reportPool("HashNode", ObjectPool<HashNode<uint32_t, OrderHandle>>::stats());
+}
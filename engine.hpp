@@ -4,97 +4,277 @@
 #ifndef ENGINE_HPP
 #define ENGINE_HPP
 
+#include <atomic>
 #include <chrono>
 #include <vector>
 #include <memory>
+#include <thread>
 
 #include "io.hpp"
+#include "BookSnapshot.hpp"
 #include "order.hpp"
 #include "ConcurrentHashMap.hpp"
+#include "FlatHashMap.hpp"
+#include "Instrument.hpp"
+#include "LevelFeed.hpp"
+#include "LockProfile.hpp"
+#include "MpscQueue.hpp"
+#include "PriceLadder.hpp"
+#include "Timestamp.hpp"
 
 
 /*
- * PriceLevelNode is a node in the linked list of orders at a particular price level.
- * It contains a list of orders at that price level 
- * It starts with a dummy head node.
+ * PriceLevelNode holds the orders resting at a particular price level,
+ * in an intrusive doubly linked FIFO, together with their total volume.
+ * Unlinking an order is O(1) given the order itself.
  */
 struct PriceLevelNode
 {
 	uint32_t price;
 	uint32_t total_volume;
-	PriceLevelNode* next;
-	std::mutex mtx;
-	std::vector<std::shared_ptr<Order>> orders_list;
+	uint32_t order_count;
+	Order *head;
+	Order *tail;
 
-	PriceLevelNode() : price(0), total_volume(0), next(nullptr), mtx(), orders_list() {}
-	PriceLevelNode(uint32_t price) : price(price), total_volume(0), next(nullptr), mtx(), orders_list() {}
+	PriceLevelNode() : price(0), total_volume(0), order_count(0), head(nullptr), tail(nullptr) {}
+	PriceLevelNode(uint32_t price) : price(price), total_volume(0), order_count(0), head(nullptr), tail(nullptr) {}
+
+	// a level is only torn down with orders still in it when its book is destroyed
+	~PriceLevelNode()
+	{
+		while (head)
+		{
+			Order *order = head;
+			head = head->next;
+			ObjectPool<Order>::destroy(order);
+		}
+	}
+
+	PriceLevelNode(const PriceLevelNode &) = delete;
+	PriceLevelNode &operator=(const PriceLevelNode &) = delete;
+
+	bool empty() const { return head == nullptr; }
+
+	void pushBack(Order *order)
+	{
+		order->prev = tail;
+		order->next = nullptr;
+		order->level = this;
+		(tail ? tail->next : head) = order;
+		tail = order;
+		++order_count;
+	}
+
+	void unlink(Order *order)
+	{
+		(order->prev ? order->prev->next : head) = order->next;
+		(order->next ? order->next->prev : tail) = order->prev;
+		order->prev = nullptr;
+		order->next = nullptr;
+		order->level = nullptr;
+		--order_count;
+	}
 
 	std::string toString() const
     {
         std::ostringstream oss;
         oss << "PriceLevelNode { price: " << price
             << ", total_volume: " << total_volume
-            << ", orders_count: " << orders_list.size()
+            << ", orders_count: " << order_count
             << " }";
         return oss.str();
     }
 };
 
+using SideMutex = ProfiledMutex<LockClass::BookSide>;
+using SideLock = std::unique_lock<SideMutex>;
+
 /*
- * BuyBook is a linked list of PriceLevelNodes representing the buy side of the order book.
- * It starts with a dummy head node.
+ * BuyBook is a price ladder of PriceLevelNodes representing the buy side of the order book.
+ * Best level is the highest price. mtx guards the whole side.
  */
 struct BuyBook
 {
-	PriceLevelNode* head;
+	PriceLadder<PriceLevelNode> levels;
+	SideMutex mtx;
 
-	BuyBook() : head(new PriceLevelNode()) {}
+	BuyBook() : levels(true), mtx() {}
 };
 
 /*
- * SellBook is a linked list of PriceLevelNodes representing the sell side of the order book.
- * It starts with a dummy head node.
+ * SellBook is a price ladder of PriceLevelNodes representing the sell side of the order book.
+ * Best level is the lowest price. mtx guards the whole side.
  */
 struct SellBook
 {
-	PriceLevelNode* head;
+	PriceLadder<PriceLevelNode> levels;
+	SideMutex mtx;
 
-	SellBook() : head(new PriceLevelNode()) {}
+	SellBook() : levels(false), mtx() {}
 };
 
+/*
+ * OrderBook holds both sides of one instrument.
+ * A single_writer book belongs to one shard thread of a sharded Engine and is
+ * mutated without taking any of its locks.
+ * Every change to a side republishes its top levels in snapshot, for readers
+ * that must not take the book's locks, and feeds the changed levels to feed.
+ */
 struct OrderBook {
-	std::string instrument;
+	uint32_t instrument_id;
+	uint64_t symbol; // packed, see packSymbol
+	bool single_writer;
 	BuyBook buy_book;
 	SellBook sell_book;
-	std::mutex mtx;
+	ProfiledMutex<LockClass::Book> mtx;
+	PublishedSnapshot snapshot;
+	LevelFeed feed;
 
-	void cancelOrder(std::shared_ptr<Order> order);
-	void matchBuyOrder(std::shared_ptr<Order> active_order, std::unique_lock<std::mutex> sell_lock);
-	void matchSellOrder(std::shared_ptr<Order> active_order, std::unique_lock<std::mutex> buy_lock);
-	void addRestingOrder(std::shared_ptr<Order> order, std::unique_lock<std::mutex> dummy_lock);
+	void processNewOrder(const ClientCommand& input);
+	void cancelOrder(uint32_t order_id, CommandType side);
+	void amendOrder(const ClientCommand& input);
+	size_t processRun(std::span<const ClientCommand> commands);
+	Order *newOrder(const ClientCommand& input) const;
+	void executeNewOrder(const ClientCommand& input, Order *order, SideLock buy_lock, SideLock sell_lock);
+	void executeCancel(uint32_t order_id);
+	void executeAmend(const ClientCommand& input, SideLock buy_lock, SideLock sell_lock);
+	bool placeOrder(Order *order, SideLock buy_lock, SideLock sell_lock);
+	bool inRun(const ClientCommand& input) const;
+	void matchBuyOrder(Order *active_order, SideLock sell_lock);
+	void matchSellOrder(Order *active_order, SideLock buy_lock);
+	void addRestingOrder(Order *order, SideLock side_lock);
+	void publishSide(bool buy_side);
+	void levelChanged(bool buy_side, const PriceLevelNode *level, bool created);
 
-	OrderBook(const std::string& instrument) : instrument(instrument), buy_book(), sell_book() {}
+	// Appends the book to a snapshot, see snapshot.hpp. The caller holds every lock of the book.
+	void capture(std::vector<char> &out);
+	// Reads one side back from a snapshot, returns where it ends.
+	const char *restoreSide(const char *data, bool buy_side, uint32_t level_count);
+
+	OrderBook(uint32_t instrument_id, uint64_t symbol, bool single_writer)
+		: instrument_id(instrument_id), symbol(symbol), single_writer(single_writer), buy_book(), sell_book()
+	{
+		LockProfiler::label(mtx, symbol, "book");
+		LockProfiler::label(buy_book.mtx, symbol, "buy side");
+		LockProfiler::label(sell_book.mtx, symbol, "sell side");
+	}
+};
+
+/*
+ * OrderHandle locates a resting order: its book, its side and the order itself,
+ * which in turn points at its PriceLevelNode. Only dereference order while
+ * holding the lock of that side, after checking the handle is still in
+ * Engine::orders_hashmap.
+ * A sharded Engine also maps orders still queued for their shard, and an amend
+ * orders it is placing again, with a null order.
+ */
+struct OrderHandle
+{
+	OrderBook *book;
+	CommandType side;
+	Order *order;
+};
+
+// Build with ORDER_MAP=chained to go back to the chained ConcurrentHashMap.
+#ifdef ORDER_MAP_CHAINED
+using OrderMap = ConcurrentHashMap<uint32_t, OrderHandle>;
+#else
+using OrderMap = FlatHashMap<uint32_t, OrderHandle>;
+#endif
+
+enum class EngineMode
+{
+	Locking, // connection threads match directly against the shared, locked books
+	Sharded  // instruments are partitioned across single-writer shard threads
+};
+
+constexpr size_t SHARD_COUNT_DEFAULT = 4;
+constexpr size_t SHARD_QUEUE_SIZE = 1 << 14;
+
+/*
+ * ClientSession tracks the commands a connection has handed to shards.
+ * A connection only moves on to another shard once its commands on the
+ * previous one are done, so its outputs keep the order of its commands.
+ */
+struct ClientSession
+{
+	size_t shard = SIZE_MAX;
+	uint64_t submitted = 0;
+	std::atomic<uint64_t> completed{0};
+};
+
+struct ShardCommand
+{
+	ClientCommand input;
+	OrderBook *book;
+	CommandType side;
+	ClientSession *session;
+	std::vector<char> *capture = nullptr; // set to snapshot book instead of running input
+};
+
+struct Shard
+{
+	MpscQueue<ShardCommand> queue;
+	std::thread thread;
+
+	Shard() : queue(SHARD_QUEUE_SIZE), thread() {}
 };
 
 struct Engine
 {
 public:
-	ConcurrentHashMap<std::string, OrderBook*> orderBooks;
-	static ConcurrentHashMap<uint32_t, std::shared_ptr<Order>> orders_hashmap;
+	InstrumentDirectory<OrderBook> orderBooks;
+	// never destroyed: detached connection and shard threads may still use it while the process exits
+	static OrderMap &orders_hashmap;
 
 	void accept(ClientConnection conn);
+	void dispatch(const ClientCommand& input, ClientSession& session);
+	void dispatch(std::span<const ClientCommand> batch, ClientSession& session);
 	void processCancelOrder(const ClientCommand& input);
+	void processAmendOrder(const ClientCommand& input);
 	void processNewOrder(const ClientCommand& input);
+	// Locking mode: runs consecutive commands for the same book under one acquisition of its locks.
+	void processBatch(std::span<const ClientCommand> batch);
+
+	// Applies a journaled command on the calling thread, in either mode. Only
+	// for startup, before any connection is accepted.
+	void replay(const ClientCommand& input);
+
+	static void reportPoolStats();
+
+	// Appends a book to a snapshot, holding up only the commands of that book.
+	void capture(OrderBook* book, std::vector<char>& out);
 
-	Engine() = default;
+	// Rebuilds one book from a snapshot at startup, before any connection is
+	// accepted. Returns where the book ends in data. The counts in data must
+	// have been checked against its size, see loadSnapshot.
+	const char* restore(const char* data, uint64_t& symbol, uint64_t& sequence);
+
+	// Copies the published top of book of an instrument without taking any book lock.
+	// Returns false if the instrument has no book yet.
+	bool snapshot(const char* instrument, BookSnapshot& out) const;
+
+	// Waits until the shards are done with the commands of a session.
+	static void drain(ClientSession& session);
+
+	explicit Engine(EngineMode mode = EngineMode::Locking, size_t shard_count = SHARD_COUNT_DEFAULT);
 
 private:
+	EngineMode mode;
+	std::vector<std::unique_ptr<Shard>> shards;
+
+	OrderBook* findOrCreateBook(const char* instrument);
+	OrderBook* findOrCreateBook(uint64_t symbol);
+	void submit(const ShardCommand& command, ClientSession& session);
+	static void rejectUnknown(const ClientCommand& input);
+
 	void connection_thread(ClientConnection conn);
+	void shard_thread(Shard* shard);
 };
 
 inline std::chrono::microseconds::rep getCurrentTimestamp() noexcept
 {
-	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	return Timestamp::current();
 }
 
 #endif
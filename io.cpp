@@ -1,7 +1,9 @@
-// This file contains I/O functions.
-// There should be no need to modify this file.
+// This file contains the buffered reads of client commands from a connection
+// and the locks of SyncCout and SyncCerr.
 
+#include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "io.hpp"
@@ -9,7 +11,7 @@
 
 // out of line definitions for the mutexes in SyncCerr/SyncCout
 std::mutex SyncCerr::mut;
-std::mutex SyncCout::mut;
+ProfiledMutex<LockClass::Output> SyncCout::mut;
 
 void ClientConnection::freeHandle()
 {
@@ -20,17 +22,65 @@ void ClientConnection::freeHandle()
 	}
 }
 
+// Reads until at least one whole command is buffered.
+ReadResult ClientConnection::fill()
+{
+	// move the part of a command we already have to the front, which keeps
+	// every buffered command aligned
+	size_t partial = m_end - m_begin;
+	memmove(rawBuffer(), rawBuffer() + m_begin, partial);
+	m_begin = 0;
+	m_end = partial;
+
+	while(m_end < sizeof(ClientCommand))
+	{
+		ssize_t bytes = read(m_handle, rawBuffer() + m_end, CONNECTION_READ_COMMANDS * sizeof(ClientCommand) - m_end);
+		switch(bytes)
+		{
+			case 0: //
+				// a command cut short by the end of the stream is an error
+				return m_end == 0 ? ReadResult::EndOfFile : ReadResult::Error;
+
+			case -1: //
+				if(errno == EINTR)
+					continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					return ReadResult::WouldBlock;
+				return ReadResult::Error;
+
+			default: //
+				m_end += static_cast<size_t>(bytes);
+				break;
+		}
+	}
+	return ReadResult::Success;
+}
+
 ReadResult ClientConnection::readInput(ClientCommand& read_into)
 {
-	switch(read(m_handle, &read_into, sizeof(ClientCommand)))
+	if(m_end - m_begin < sizeof(ClientCommand))
 	{
-		case 0: //
-			return ReadResult::EndOfFile;
+		ReadResult result = fill();
+		if(result != ReadResult::Success)
+			return result;
+	}
 
-		case sizeof(ClientCommand): //
-			return ReadResult::Success;
+	read_into = m_buffer[m_begin / sizeof(ClientCommand)];
+	m_begin += sizeof(ClientCommand);
+	return ReadResult::Success;
+}
 
-		default: //
-			return ReadResult::Error;
+ReadResult ClientConnection::readBatch(std::span<const ClientCommand>& batch)
+{
+	if(m_end - m_begin < sizeof(ClientCommand))
+	{
+		ReadResult result = fill();
+		if(result != ReadResult::Success)
+			return result;
 	}
+
+	size_t count = (m_end - m_begin) / sizeof(ClientCommand);
+	batch = std::span<const ClientCommand>(m_buffer.get() + m_begin / sizeof(ClientCommand), count);
+	m_begin += count * sizeof(ClientCommand);
+	return ReadResult::Success;
 }
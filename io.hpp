@@ -1,18 +1,27 @@
-// This file contains definitions used by the provided I/O code.
-// There should be no need to modify this file.
+// This file contains the client command format, the buffered per-connection
+// reader, and Output, which prints the engine's events to stdout or hands them
+// to the OutputPipeline.
 
 #pragma once
 
 #include <mutex>
+#include <span>
+#include <memory>
 #include <utility>
 #include <cstdint>
 #include <iostream>
+#include <cstring>
+
+#include "output.hpp"
+#include "LatencyStats.hpp"
+#include "LockProfile.hpp"
 
 enum CommandType
 {
 	input_buy = 'B',
 	input_sell = 'S',
-	input_cancel = 'C'
+	input_cancel = 'C',
+	input_amend = 'A' // new price and count of a resting order, no instrument
 };
 
 struct ClientCommand
@@ -28,15 +37,29 @@ enum class ReadResult
 {
 	Success,
 	EndOfFile,
-	Error
+	Error,
+	WouldBlock // only for non-blocking handles: no whole command available yet
 };
 
+constexpr size_t CONNECTION_READ_COMMANDS = 16384 / sizeof(ClientCommand);
+
+// Reads go through a per-connection buffer: one read() pulls in as many
+// commands as the socket has, and a command split across reads is kept
+// until the rest of it arrives.
+// The buffer is an array of ClientCommand that read() fills in byte by byte,
+// so whole commands can be handed out in place. Only the bytes of a command
+// split across reads are not a whole command yet, and are only accessed as bytes.
 struct ClientConnection
 {
 	~ClientConnection() { this->freeHandle(); }
-	explicit ClientConnection(int handle) : m_handle(handle) { }
+	explicit ClientConnection(int handle)
+	    : m_handle(handle), m_buffer(new ClientCommand[CONNECTION_READ_COMMANDS]), m_begin(0), m_end(0) { }
 
-	ClientConnection(ClientConnection&& other) : m_handle(std::exchange(other.m_handle, -1)) { }
+	ClientConnection(ClientConnection&& other)
+	    : m_handle(std::exchange(other.m_handle, -1))
+	    , m_buffer(std::move(other.m_buffer))
+	    , m_begin(std::exchange(other.m_begin, 0))
+	    , m_end(std::exchange(other.m_end, 0)) { }
 	ClientConnection& operator=(ClientConnection&& other)
 	{
 		if(&other == this)
@@ -44,6 +67,9 @@ struct ClientConnection
 
 		this->freeHandle();
 		m_handle = std::exchange(other.m_handle, -1);
+		m_buffer = std::move(other.m_buffer);
+		m_begin = std::exchange(other.m_begin, 0);
+		m_end = std::exchange(other.m_end, 0);
 
 		return *this;
 	}
@@ -53,17 +79,28 @@ struct ClientConnection
 
 	ReadResult readInput(ClientCommand& read_into);
 
+	// Hands out every whole command received so far, reading from the socket
+	// if there is none. The span stays valid until the next read call.
+	ReadResult readBatch(std::span<const ClientCommand>& batch);
+
+	int handle() const { return m_handle; }
+
 private:
 	int m_handle;
+	std::unique_ptr<ClientCommand[]> m_buffer;
+	size_t m_begin; // first byte not handed out yet, always at the start of a command
+	size_t m_end;   // end of the bytes received
 	void freeHandle();
+	char* rawBuffer() { return reinterpret_cast<char*>(m_buffer.get()); }
+	ReadResult fill();
 };
 
 // An implementation of std::osyncstream{std::cout}
 // std::osyncstream would work but badly supported right now
 struct SyncCout
 {
-	static std::mutex mut;
-	std::scoped_lock<std::mutex> lock { SyncCout::mut };
+	static ProfiledMutex<LockClass::Output> mut;
+	std::scoped_lock<ProfiledMutex<LockClass::Output>> lock { SyncCout::mut };
 
 	template <typename T>
 	friend const SyncCout& operator<<(const SyncCout& s, T&& v)
@@ -100,12 +137,33 @@ struct SyncCerr
 	}
 };
 
+// Writes go through OutputPipeline when it is running, straight to stdout otherwise.
+// Nothing is written while muted, e.g. while the books are rebuilt at startup.
 class Output
 {
 public:
+	static inline bool muted = false;
+
 	inline static void
 	OrderAdded(uint32_t id, const char* symbol, uint32_t price, uint32_t count, bool is_sell_side, intmax_t output_timestamp)
 	{
+		if(muted)
+			return;
+		OutputLatency latency;
+
+		if(OutputPipeline::enabled())
+		{
+			OutputEvent event{};
+			event.kind = is_sell_side ? OutputEvent::AddedSell : OutputEvent::AddedBuy;
+			event.id = id;
+			std::memcpy(event.symbol, symbol, strnlen(symbol, sizeof(event.symbol) - 1));
+			event.price = price;
+			event.count = count;
+			event.timestamp = output_timestamp;
+			OutputPipeline::push(event);
+			return;
+		}
+
 		SyncCout()
 		    << (is_sell_side ? "S " : "B ") //
 		    << id << " "                    //
@@ -123,6 +181,24 @@ public:
 	    uint32_t count,
 	    intmax_t output_timestamp)
 	{
+		if(muted)
+			return;
+		OutputLatency latency;
+
+		if(OutputPipeline::enabled())
+		{
+			OutputEvent event{};
+			event.kind = OutputEvent::Executed;
+			event.id = resting_id;
+			event.new_id = new_id;
+			event.execution_id = execution_id;
+			event.price = price;
+			event.count = count;
+			event.timestamp = output_timestamp;
+			OutputPipeline::push(event);
+			return;
+		}
+
 		SyncCout()
 		    << "E "                //
 		    << resting_id << " "   //
@@ -136,6 +212,21 @@ public:
 
 	inline static void OrderDeleted(uint32_t id, bool cancel_accepted, intmax_t output_timestamp)
 	{
+		if(muted)
+			return;
+		OutputLatency latency;
+
+		if(OutputPipeline::enabled())
+		{
+			OutputEvent event{};
+			event.kind = OutputEvent::Deleted;
+			event.id = id;
+			event.accepted = cancel_accepted;
+			event.timestamp = output_timestamp;
+			OutputPipeline::push(event);
+			return;
+		}
+
 		SyncCout()
 		    << "X "                            //
 		    << id << " "                       //
@@ -143,4 +234,33 @@ public:
 		    << output_timestamp                //
 		    << std::endl;
 	}
+
+	inline static void OrderAmended(uint32_t id, bool amend_accepted, uint32_t price, uint32_t count, intmax_t output_timestamp)
+	{
+		if(muted)
+			return;
+		OutputLatency latency;
+
+		if(OutputPipeline::enabled())
+		{
+			OutputEvent event{};
+			event.kind = OutputEvent::Amended;
+			event.id = id;
+			event.accepted = amend_accepted;
+			event.price = price;
+			event.count = count;
+			event.timestamp = output_timestamp;
+			OutputPipeline::push(event);
+			return;
+		}
+
+		SyncCout()
+		    << "M "                           //
+		    << id << " "                      //
+		    << (amend_accepted ? "A " : "R ") //
+		    << price << " "                   //
+		    << count << " "                   //
+		    << output_timestamp               //
+		    << std::endl;
+	}
 };
\ No newline at end of file
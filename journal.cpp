@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Instrument.hpp"
+#include "journal.hpp"
+
+std::atomic<bool> Journal::active{false};
+
+namespace
+{
+
+constexpr char JOURNAL_MAGIC[8] = {'O', 'B', 'J', 'O', 'U', 'R', 'N', '1'};
+constexpr std::chrono::microseconds SYNCER_IDLE_SLEEP{50};
+
+struct Log
+{
+	JournalConfig config;
+	char *base = nullptr;
+	size_t size = 0;
+	JournalHeader *header = nullptr;
+	JournalRecord *records = nullptr;
+	uint64_t capacity = 0;
+	uint64_t end = 0; // records found by open
+	uint16_t generation = 0;
+
+	std::atomic<uint64_t> next_sequence{1};
+	std::atomic<uint64_t> sync_requested{0}; // sync through here without waiting for a group
+	std::atomic<uint64_t> durable{0};        // records synced so far
+	std::atomic<bool> stopping{false};
+	std::thread syncer;
+
+	void sync(uint64_t from, uint64_t to);
+	void run();
+};
+
+Log journal;
+
+// Writes records [from, to) back to the file and waits for it.
+void Log::sync(uint64_t from, uint64_t to)
+{
+	static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t first = reinterpret_cast<char *>(records + from) - base;
+	size_t last = reinterpret_cast<char *>(records + to) - base;
+	first -= first % page;
+	if (msync(base + first, last - first, MS_SYNC) == -1)
+		perror("msync");
+}
+
+void Log::run()
+{
+	// Journal::stop joins this thread at exit, so exit signals must go to another thread
+	sigset_t exit_signals;
+	sigemptyset(&exit_signals);
+	sigaddset(&exit_signals, SIGINT);
+	sigaddset(&exit_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &exit_signals, nullptr);
+
+	uint64_t complete = end; // records known to be fully written
+	uint64_t synced = end;
+	auto oldest = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		bool stop = stopping.load(std::memory_order_acquire);
+
+		// appends finish out of order; only sync up to the first one still being written
+		uint64_t claimed = std::min(next_sequence.load(std::memory_order_acquire) - 1, capacity);
+		uint64_t before = complete;
+		while (complete < claimed &&
+		       std::atomic_ref<uint64_t>(records[complete].sequence).load(std::memory_order_acquire) == complete + 1)
+			++complete;
+		if (before == synced && complete > synced)
+			oldest = std::chrono::steady_clock::now();
+
+		if (complete > synced &&
+		    (stop || (complete - synced) * sizeof(JournalRecord) >= config.sync_bytes ||
+		     std::chrono::steady_clock::now() - oldest >= config.sync_interval ||
+		     synced < sync_requested.load(std::memory_order_acquire)))
+		{
+			sync(synced, complete);
+			synced = complete;
+			durable.store(synced, std::memory_order_release);
+		}
+
+		if (stop)
+			return;
+
+		if (complete == before)
+			std::this_thread::sleep_for(SYNCER_IDLE_SLEEP);
+	}
+}
+
+} // namespace
+
+bool Journal::open(const JournalConfig &config)
+{
+	journal.config = config;
+	int fd = ::open(config.path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		perror(config.path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		perror("fstat");
+		close(fd);
+		return false;
+	}
+	bool created = st.st_size == 0;
+	journal.size = std::max(static_cast<size_t>(st.st_size), config.size);
+
+	// allocate every block now, so syncing never has to update the file's metadata
+	int error = posix_fallocate(fd, 0, static_cast<off_t>(journal.size));
+	if (error != 0)
+	{
+		fprintf(stderr, "posix_fallocate: %s\n", strerror(error));
+		close(fd);
+		return false;
+	}
+
+	void *mapped = mmap(nullptr, journal.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		perror("mmap");
+		return false;
+	}
+
+	journal.base = static_cast<char *>(mapped);
+	journal.header = reinterpret_cast<JournalHeader *>(journal.base);
+	journal.records = reinterpret_cast<JournalRecord *>(journal.base + sizeof(JournalHeader));
+	journal.capacity = (journal.size - sizeof(JournalHeader)) / sizeof(JournalRecord);
+
+	JournalHeader *header = journal.header;
+	if (created)
+	{
+		std::memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+		header->record_size = sizeof(JournalRecord);
+	}
+	else if (std::memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header->record_size != sizeof(JournalRecord))
+	{
+		fprintf(stderr, "%s is not a journal\n", config.path);
+		return false;
+	}
+
+	uint64_t end = 0;
+	for (; end < journal.capacity; ++end)
+	{
+		const JournalRecord &record = journal.records[end];
+		if (record.sequence != end + 1)
+			break;
+		if (end >= header->base && record.generation != static_cast<uint16_t>(header->generation))
+			break;
+	}
+	journal.end = end;
+
+	// this run appends after what was found, under a new generation
+	header->generation++;
+	header->base = end;
+	journal.generation = static_cast<uint16_t>(header->generation);
+	journal.next_sequence.store(end + 1, std::memory_order_relaxed);
+	if (msync(journal.base, sizeof(JournalHeader), MS_SYNC) == -1)
+	{
+		perror("msync");
+		return false;
+	}
+	return true;
+}
+
+uint64_t Journal::replay(uint64_t after, const std::function<void(uint64_t sequence, const ClientCommand &)> &apply)
+{
+	uint64_t replayed = 0;
+	for (uint64_t i = after; i < journal.end; ++i, ++replayed)
+	{
+		const JournalRecord &record = journal.records[i];
+		ClientCommand command{};
+		command.type = static_cast<CommandType>(record.type);
+		command.order_id = record.order_id;
+		command.price = record.price;
+		command.count = record.count;
+		unpackSymbol(record.symbol, command.instrument);
+		apply(record.sequence, command);
+	}
+	return replayed;
+}
+
+void Journal::start()
+{
+	journal.durable.store(journal.end, std::memory_order_relaxed);
+	journal.syncer = std::thread(&Log::run, &journal);
+	active.store(true, std::memory_order_release);
+}
+
+void Journal::stop()
+{
+	if (!active.exchange(false))
+		return;
+
+	journal.stopping.store(true, std::memory_order_release);
+	journal.syncer.join();
+}
+
+void Journal::syncThrough(uint64_t sequence)
+{
+	uint64_t requested = journal.sync_requested.load(std::memory_order_relaxed);
+	while (requested < sequence && !journal.sync_requested.compare_exchange_weak(requested, sequence, std::memory_order_release))
+		;
+	// the syncer also waits for appends below sequence that are still being written
+	while (enabled() && journal.durable.load(std::memory_order_acquire) < sequence)
+		std::this_thread::sleep_for(SYNCER_IDLE_SLEEP);
+}
+
+uint64_t Journal::sequence()
+{
+	return journal.next_sequence.load(std::memory_order_relaxed) - 1;
+}
+
+void Journal::append(const ClientCommand &command)
+{
+	uint64_t sequence = journal.next_sequence.fetch_add(1, std::memory_order_relaxed);
+	if (sequence > journal.capacity)
+	{
+		// the books may no longer be rebuilt from the journal, so they must not change
+		SyncCerr{} << "Journal full after " << journal.capacity << " commands" << std::endl;
+		std::abort();
+	}
+
+	JournalRecord &record = journal.records[sequence - 1];
+	std::atomic_ref<uint64_t> record_sequence(record.sequence);
+
+	// the slot may hold a record left over from a crashed run: invalidate it
+	// before rewriting it, so that a crash now cannot leave half of each behind
+	record_sequence.store(0, std::memory_order_relaxed);
+	record.symbol = packSymbol(command.instrument);
+	record.order_id = command.order_id;
+	record.price = command.price;
+	record.count = command.count;
+	record.type = static_cast<char>(command.type);
+	record.reserved = 0;
+	record.generation = journal.generation;
+	record_sequence.store(sequence, std::memory_order_release);
+}
@@ -0,0 +1,107 @@
+// This file contains declarations for the write-ahead journal, which records
+// every command the books accept so that they can be rebuilt after a restart.
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "io.hpp"
+
+constexpr size_t JOURNAL_SIZE_DEFAULT = size_t(1) << 30;
+constexpr size_t JOURNAL_SYNC_BYTES_DEFAULT = 1 << 16;
+constexpr std::chrono::microseconds JOURNAL_SYNC_INTERVAL_DEFAULT{1000};
+
+/*
+ * The journal is a preallocated file, mapped into memory, holding a 64-byte
+ * JournalHeader followed by fixed-size JournalRecords in host byte order.
+ * Record i holds sequence number i + 1, so appending is a fetch_add and a copy.
+ *
+ * sequence is written last: a record whose sequence does not match its slot is
+ * where the journal ends. After a crash, records past the end may be left over
+ * from appends that overtook an unfinished one. Every run therefore stamps its
+ * records with its generation, and a record at or past the base the run
+ * started at only counts if it carries that run's generation.
+ */
+struct JournalHeader
+{
+	char magic[8];
+	uint32_t record_size;
+	uint32_t generation; // of the current run
+	uint64_t base;       // records the current run started with
+	uint64_t reserved[5];
+};
+
+struct JournalRecord
+{
+	uint64_t sequence;
+	uint64_t symbol; // of the book, packed, see packSymbol
+	uint32_t order_id;
+	uint32_t price;
+	uint32_t count;
+	char type;       // CommandType
+	uint8_t reserved;
+	uint16_t generation;
+};
+
+static_assert(sizeof(JournalHeader) == 64);
+static_assert(sizeof(JournalRecord) == 32);
+
+struct JournalConfig
+{
+	const char *path = nullptr;
+	size_t size = JOURNAL_SIZE_DEFAULT;                                        // preallocated, grown to if the file is smaller
+	size_t sync_bytes = JOURNAL_SYNC_BYTES_DEFAULT;                            // sync once this much is unsynced
+	std::chrono::microseconds sync_interval = JOURNAL_SYNC_INTERVAL_DEFAULT; // or once the oldest unsynced record is this old
+};
+
+/*
+ * Journal appends commands from the engine threads while they hold the locks
+ * of the book the command applies to, so replaying the journal in sequence
+ * order applies every book's commands in the order they originally ran.
+ * Appending never waits for the disk: a syncer thread commits the records in
+ * groups, once enough of them are pending or the oldest has waited long enough.
+ * A crash of the process loses nothing, since the records are already in the
+ * page cache; losing the machine loses at most the last group.
+ * A snapshot reflects the journal up to its newest book's sequence number, so
+ * SnapshotWriter calls syncThrough with it before putting the snapshot in
+ * place: a durable snapshot is never newer than the durable journal.
+ */
+class Journal
+{
+public:
+	// Maps the journal, creating it if needed, and finds where it ends.
+	// Returns false, having reported why, if it cannot be used.
+	static bool open(const JournalConfig &config);
+
+	// Hands the commands after sequence number after to apply, in order.
+	// Returns how many there were.
+	static uint64_t replay(uint64_t after, const std::function<void(uint64_t sequence, const ClientCommand &)> &apply);
+
+	// Starts the syncer and appending, which continues the sequence after the replayed commands.
+	static void start();
+
+	// Syncs what has been appended and stops the syncer.
+	static void stop();
+
+	static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+	static void append(const ClientCommand &command);
+
+	// Waits until the records up to sequence are on disk, asking the syncer
+	// to sync them now rather than with its next group.
+	static void syncThrough(uint64_t sequence);
+
+	// The last sequence number appended, or found by open before start.
+	// Holding the locks of a book, no command of that book can be past it.
+	static uint64_t sequence();
+
+private:
+	static std::atomic<bool> active;
+};
+
+#endif
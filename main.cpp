@@ -1,20 +1,40 @@
-// This file contains main() as well as the logic setting up the I/O.
-// There should be no need to modify this file.
+// This file contains main(): option parsing, restoring the books from the
+// journal and snapshot, the background threads (output, journal, snapshots,
+// market data, stats signals), and accepting connections on a thread per
+// connection or on epoll reactors.
 
 #include <stdio.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <getopt.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include "io.hpp"
 #include "engine.hpp"
+#include "journal.hpp"
+#include "snapshot.hpp"
+#include "marketdata.hpp"
+#include "reactor.hpp"
 
 static int listenfd = -1;
 static char* socketpath = NULL;
+static bool report_pool_stats = false;
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr,
+	    "Usage: %s [--engine=locking|sharded] [--shards=<count>] [--io=threads|epoll] [--reactors=<count>]\n"
+	    "          [--output=sync|async] [--format=text|binary] [--flush-bytes=<bytes>] [--flush-us=<microseconds>]\n"
+	    "          [--clock=steady|tsc] [--timestamps=event|command] [--md-socket=<path>] [--md-interval-us=<microseconds>]\n"
+	    "          [--journal=<path>] [--journal-size=<bytes>] [--journal-sync-bytes=<bytes>] [--journal-sync-us=<microseconds>]\n"
+	    "          [--snapshot=<path>] [--snapshot-interval-ms=<milliseconds>]\n"
+	    "          [--backlog=<count>] [--pool-stats] [--latency-stats] <socket path>\n",
+	    argv0);
+}
 
 static void handle_exit_signal(int signum)
 {
@@ -24,6 +44,13 @@ static void handle_exit_signal(int signum)
 
 static void exit_cleanup(void)
 {
+	OutputPipeline::stop();
+	Journal::stop();
+
+	if(report_pool_stats)
+		Engine::reportPoolStats();
+	LockProfiler::report(stderr);
+
 	if(listenfd == -1)
 		return;
 
@@ -34,13 +61,227 @@ static void exit_cleanup(void)
 
 int main(int argc, char* argv[])
 {
-	if(argc < 2)
+	static const struct option long_options[] = {
+		{ "engine", required_argument, NULL, 'e' },
+		{ "shards", required_argument, NULL, 's' },
+		{ "io", required_argument, NULL, 'i' },
+		{ "reactors", required_argument, NULL, 'r' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "format", required_argument, NULL, 't' },
+		{ "flush-bytes", required_argument, NULL, 'f' },
+		{ "flush-us", required_argument, NULL, 'u' },
+		{ "clock", required_argument, NULL, 'c' },
+		{ "timestamps", required_argument, NULL, 'm' },
+		{ "md-socket", required_argument, NULL, 'd' },
+		{ "md-interval-us", required_argument, NULL, 'n' },
+		{ "journal", required_argument, NULL, 'j' },
+		{ "journal-size", required_argument, NULL, 'z' },
+		{ "journal-sync-bytes", required_argument, NULL, 'y' },
+		{ "journal-sync-us", required_argument, NULL, 'w' },
+		{ "snapshot", required_argument, NULL, 'a' },
+		{ "snapshot-interval-ms", required_argument, NULL, 'g' },
+		{ "backlog", required_argument, NULL, 'b' },
+		{ "pool-stats", no_argument, NULL, 'p' },
+		{ "latency-stats", no_argument, NULL, 'l' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	EngineMode mode = EngineMode::Locking;
+	size_t shard_count = SHARD_COUNT_DEFAULT;
+	bool use_epoll = false;
+	size_t reactor_count = REACTOR_THREADS_DEFAULT;
+	OutputConfig output_config;
+	ClockSource clock_source = ClockSource::Steady;
+	bool per_command_timestamps = false;
+	const char* md_socket = NULL;
+	std::chrono::microseconds md_interval = MD_INTERVAL_DEFAULT;
+	JournalConfig journal_config;
+	const char* snapshot_path = NULL;
+	std::chrono::milliseconds snapshot_interval = SNAPSHOT_INTERVAL_DEFAULT;
+	int backlog = 8;
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
 	{
-		fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+		switch(opt)
+		{
+			case 'e':
+				if(strcmp(optarg, "locking") == 0)
+					mode = EngineMode::Locking;
+				else if(strcmp(optarg, "sharded") == 0)
+					mode = EngineMode::Sharded;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 's':
+				shard_count = strtoul(optarg, NULL, 10);
+				if(shard_count == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'i':
+				if(strcmp(optarg, "threads") == 0)
+					use_epoll = false;
+				else if(strcmp(optarg, "epoll") == 0)
+					use_epoll = true;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'r':
+				reactor_count = strtoul(optarg, NULL, 10);
+				if(reactor_count == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'o':
+				if(strcmp(optarg, "sync") == 0)
+					output_config.async = false;
+				else if(strcmp(optarg, "async") == 0)
+					output_config.async = true;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 't':
+				if(strcmp(optarg, "text") == 0)
+					output_config.format = OutputFormat::Text;
+				else if(strcmp(optarg, "binary") == 0)
+					output_config.format = OutputFormat::Binary;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'f':
+				output_config.flush_bytes = strtoul(optarg, NULL, 10);
+				if(output_config.flush_bytes == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'u': output_config.flush_interval = std::chrono::microseconds(strtoul(optarg, NULL, 10)); break;
+			case 'c':
+				if(strcmp(optarg, "steady") == 0)
+					clock_source = ClockSource::Steady;
+				else if(strcmp(optarg, "tsc") == 0)
+					clock_source = ClockSource::Tsc;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'm':
+				if(strcmp(optarg, "event") == 0)
+					per_command_timestamps = false;
+				else if(strcmp(optarg, "command") == 0)
+					per_command_timestamps = true;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'd': md_socket = optarg; break;
+			case 'n':
+				md_interval = std::chrono::microseconds(strtoul(optarg, NULL, 10));
+				if(md_interval.count() == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'j': journal_config.path = optarg; break;
+			case 'z':
+				journal_config.size = strtoull(optarg, NULL, 10);
+				if(journal_config.size < sizeof(JournalHeader) + sizeof(JournalRecord))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'y':
+				journal_config.sync_bytes = strtoul(optarg, NULL, 10);
+				if(journal_config.sync_bytes == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'w': journal_config.sync_interval = std::chrono::microseconds(strtoul(optarg, NULL, 10)); break;
+			case 'a': snapshot_path = optarg; break;
+			case 'g':
+				snapshot_interval = std::chrono::milliseconds(strtoul(optarg, NULL, 10));
+				if(snapshot_interval.count() == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'b':
+				backlog = atoi(optarg);
+				if(backlog <= 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'p': report_pool_stats = true; break;
+			case 'l': LatencyStats::enabled = true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	// a snapshot is only of use with the journal after it
+	if(optind != argc - 1 || (snapshot_path && !journal_config.path))
+	{
+		usage(argv[0]);
 		return 1;
 	}
 
-	socketpath = argv[1];
+	if(Timestamp::init(clock_source) != clock_source)
+		fprintf(stderr, "No invariant TSC, using steady_clock\n");
+	Timestamp::setPerCommand(per_command_timestamps);
+
+	// SIGUSR1 dumps the latency stats, SIGUSR2 the lock profile. Blocked before
+	// any other thread starts, so only the stats thread takes them.
+	if(LatencyStats::enabled || LockProfiler::enabled)
+	{
+		sigset_t stats_signals;
+		sigemptyset(&stats_signals);
+		if(LatencyStats::enabled)
+			sigaddset(&stats_signals, SIGUSR1);
+		if(LockProfiler::enabled)
+			sigaddset(&stats_signals, SIGUSR2);
+		pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+		std::thread([stats_signals]()
+		{
+			int signum;
+			while(sigwait(&stats_signals, &signum) == 0)
+			{
+				if(signum == SIGUSR1)
+					LatencyStats::dump(stderr);
+				else
+					LockProfiler::report(stderr);
+			}
+		}).detach();
+	}
+
+	socketpath = argv[optind];
 	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if(listenfd == -1)
 	{
@@ -51,7 +292,7 @@ int main(int argc, char* argv[])
 	{
 		struct sockaddr_un sockaddr {};
 		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
+		strncpy(sockaddr.sun_path, socketpath, sizeof(sockaddr.sun_path) - 1);
 		if(bind(listenfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 		{
 			perror("bind");
@@ -59,17 +300,57 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if(output_config.async || output_config.format == OutputFormat::Binary)
+		OutputPipeline::start(output_config);
+
 	atexit(exit_cleanup);
 	signal(SIGINT, handle_exit_signal);
 	signal(SIGTERM, handle_exit_signal);
 
-	if(listen(listenfd, 8) != 0)
+	if(listen(listenfd, backlog) != 0)
 	{
 		perror("listen");
 		return 1;
 	}
 
-	auto engine = new Engine();
+	// books created from here on feed the publisher
+	LevelFeed::enabled = md_socket != NULL;
+	auto engine = new Engine(mode, shard_count);
+	if(journal_config.path)
+	{
+		if(!Journal::open(journal_config))
+			return 1;
+
+		// rebuild the books from the newest snapshot and what was journaled after it,
+		// without repeating its output
+		RestoredSnapshot restored;
+		Output::muted = true;
+		if(snapshot_path && !loadSnapshot(*engine, snapshot_path, restored))
+			return 1;
+		if(restored.newest > Journal::sequence())
+		{
+			fprintf(stderr, "%s is newer than the journal\n", snapshot_path);
+			return 1;
+		}
+		uint64_t replayed = 0;
+		Journal::replay(restored.sequence, [engine, &restored, &replayed](uint64_t sequence, const ClientCommand& command)
+		{
+			if(restored.covers(sequence, command))
+				return;
+			engine->replay(command);
+			++replayed;
+		});
+		Output::muted = false;
+		if(restored.books.size() > 0 || replayed > 0)
+			fprintf(stderr, "Restored %zu books from the snapshot, replayed %llu journaled commands\n", restored.books.size(), (unsigned long long) replayed);
+		Journal::start();
+
+		if(snapshot_path)
+			new SnapshotWriter(*engine, snapshot_path, snapshot_interval);
+	}
+	if(md_socket)
+		new L2Publisher(*engine, md_socket, md_interval);
+	auto reactor = use_epoll ? new Reactor(*engine, reactor_count) : nullptr;
 	while(true)
 	{
 		int connfd = accept(listenfd, NULL, NULL);
@@ -79,7 +360,10 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
-		engine->accept(ClientConnection(connfd));
+		if(reactor)
+			reactor->add(ClientConnection(connfd));
+		else
+			engine->accept(ClientConnection(connfd));
 	}
 
 	return 0;
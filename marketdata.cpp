@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "marketdata.hpp"
+
+namespace
+{
+
+struct LevelUpdate
+{
+	uint32_t price;
+	LevelDelta delta;
+	LevelUpdateKind kind;
+};
+
+void put16(char *out, uint16_t value)
+{
+	for (size_t i = 0; i < 2; ++i)
+		out[i] = static_cast<char>(value >> (8 * i));
+}
+
+void put32(char *out, uint32_t value)
+{
+	for (size_t i = 0; i < 4; ++i)
+		out[i] = static_cast<char>(value >> (8 * i));
+}
+
+void put64(char *out, uint64_t value)
+{
+	for (size_t i = 0; i < 8; ++i)
+		out[i] = static_cast<char>(value >> (8 * i));
+}
+
+void encode(char *out, uint64_t symbol, uint64_t sequence, bool buy_side, const LevelUpdate &update)
+{
+	put64(out, symbol);
+	put64(out + 8, sequence);
+	put32(out + 16, update.price);
+	put32(out + 20, update.delta.volume);
+	put32(out + 24, update.delta.orders);
+	out[28] = buy_side ? 'B' : 'S';
+	out[29] = static_cast<char>(update.kind);
+	put16(out + 30, 0);
+}
+
+} // namespace
+
+L2Publisher::L2Publisher(Engine &engine, const char *socket_path, std::chrono::microseconds interval)
+	: engine(engine), socket_path(socket_path), interval(interval), fd(-1), address{}, thread()
+{
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+	{
+		perror("socket");
+		exit(1);
+	}
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socket_path, strnlen(socket_path, sizeof(address.sun_path) - 1));
+
+	thread = std::thread(&L2Publisher::publisher_thread, this);
+	thread.detach();
+}
+
+void L2Publisher::publisher_thread()
+{
+	while (true)
+	{
+		std::this_thread::sleep_for(interval);
+
+		// once the socket is full, leave the remaining books for the next round
+		bool blocked = false;
+		engine.orderBooks.forEach([&](OrderBook *book)
+		{
+			if (!blocked)
+				blocked = !publishBook(book);
+		});
+	}
+}
+
+/*
+ * Publishes the pending changes of one book, bids first.
+ * Returns false if the socket was full; the unsent changes are back in the book.
+ */
+bool L2Publisher::publishBook(OrderBook *book)
+{
+	if (!book->feed.takeDirty())
+		return true;
+
+	std::unordered_map<uint32_t, LevelDelta> changes;
+	for (bool buy_side : {true, false})
+	{
+		changes.clear();
+		book->feed.take(buy_side, changes);
+		if (!publishSide(book, buy_side, changes))
+		{
+			// restoring the unsent changes marked the book dirty again, which
+			// also covers a side not taken yet
+			return false;
+		}
+	}
+	return true;
+}
+
+bool L2Publisher::publishSide(OrderBook *book, bool buy_side, std::unordered_map<uint32_t, LevelDelta> &changes)
+{
+	std::vector<LevelUpdate> updates;
+	updates.reserve(changes.size());
+	for (const auto &[price, delta] : changes)
+	{
+		if (!delta.existed)
+		{
+			// created and gone again since the last round: consumers never need to know
+			if (delta.volume > 0)
+				updates.push_back(LevelUpdate{price, delta, LevelUpdateKind::New});
+		}
+		else
+		{
+			updates.push_back(LevelUpdate{price, delta, delta.volume > 0 ? LevelUpdateKind::Changed : LevelUpdateKind::Deleted});
+		}
+	}
+	std::sort(updates.begin(), updates.end(), [](const LevelUpdate &a, const LevelUpdate &b) { return a.price < b.price; });
+
+	char datagram[MD_DATAGRAM_RECORDS * MD_RECORD_SIZE];
+	for (size_t first = 0; first < updates.size(); first += MD_DATAGRAM_RECORDS)
+	{
+		size_t count = std::min(MD_DATAGRAM_RECORDS, updates.size() - first);
+		for (size_t i = 0; i < count; ++i)
+			encode(datagram + i * MD_RECORD_SIZE, book->symbol, book->feed.sequence + 1 + i, buy_side, updates[first + i]);
+
+		ssize_t sent = sendto(fd, datagram, count * MD_RECORD_SIZE, MSG_DONTWAIT,
+		                      reinterpret_cast<const struct sockaddr *>(&address), sizeof(address));
+		if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+		{
+			// the consumer is behind: keep the rest, conflated, for the next round
+			for (size_t i = first; i < updates.size(); ++i)
+				book->feed.restore(buy_side, updates[i].price, updates[i].delta);
+			return false;
+		}
+
+		// sent, or nobody is listening: either way these sequence numbers are used up,
+		// so a consumer that joins later can tell it missed updates
+		book->feed.sequence += count;
+	}
+	return true;
+}
@@ -0,0 +1,71 @@
+// This file contains declarations for the L2 market-data feed, which publishes
+// incremental price-level updates derived from the books' LevelFeeds.
+
+#ifndef MARKETDATA_HPP
+#define MARKETDATA_HPP
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/un.h>
+
+#include "engine.hpp"
+
+constexpr std::chrono::microseconds MD_INTERVAL_DEFAULT{1000};
+constexpr size_t MD_RECORD_SIZE = 32;
+constexpr size_t MD_DATAGRAM_RECORDS = 128;
+
+/*
+ * Each update is a little-endian record of MD_RECORD_SIZE bytes:
+ *
+ *   0  u64 symbol (packed, see packSymbol)
+ *   8  u64 sequence, per instrument, without gaps unless a datagram was lost
+ *  16  u32 price
+ *  20  u32 volume
+ *  24  u32 orders
+ *  28  u8  side ('B' or 'S')
+ *  29  u8  kind ('N' new level, 'C' changed level, 'D' deleted level)
+ *  30  u16 0
+ *
+ * A datagram carries up to MD_DATAGRAM_RECORDS updates of a single instrument.
+ */
+enum class LevelUpdateKind : char
+{
+	New = 'N',
+	Changed = 'C',
+	Deleted = 'D'
+};
+
+/*
+ * L2Publisher sends the conflated level changes of every book to a unix
+ * datagram socket, every interval. Sends never block: if the consumer falls
+ * behind and the socket is full, the unsent changes go back into their books,
+ * still conflated, and are retried on the next round. A level created and
+ * deleted between two rounds is never published at all.
+ */
+class L2Publisher
+{
+public:
+	// Starts publishing to the datagram socket bound at socket_path. Nobody needs
+	// to be listening yet: updates sent while nobody is are lost.
+	L2Publisher(Engine &engine, const char *socket_path, std::chrono::microseconds interval);
+
+	L2Publisher(const L2Publisher &) = delete;
+	L2Publisher &operator=(const L2Publisher &) = delete;
+
+private:
+	Engine &engine;
+	std::string socket_path;
+	std::chrono::microseconds interval;
+	int fd;
+	struct sockaddr_un address;
+	std::thread thread;
+
+	void publisher_thread();
+	bool publishBook(OrderBook *book);
+	bool publishSide(OrderBook *book, bool buy_side, std::unordered_map<uint32_t, LevelDelta> &changes);
+};
+
+#endif
@@ -1,11 +1,18 @@
 #include "io.hpp"
 
+struct PriceLevelNode;
+
 struct Order
 {
-    enum CommandType type;
-    std::string instrument;
-    uint32_t order_id;
-    uint32_t execution_id;
-    uint32_t price;
-    uint32_t count;
-};
\ No newline at end of file
+	enum CommandType type;
+	uint32_t instrument_id;
+	uint32_t order_id;
+	uint32_t execution_id;
+	uint32_t price;
+	uint32_t count;
+
+	// intrusive links into the FIFO of the price level the order rests at
+	Order *prev = nullptr;
+	Order *next = nullptr;
+	PriceLevelNode *level = nullptr;
+};
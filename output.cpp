@@ -0,0 +1,436 @@
+#include <charconv>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "output.hpp"
+#include "LockProfile.hpp"
+
+std::atomic<bool> OutputPipeline::active{false};
+
+namespace
+{
+
+constexpr std::chrono::microseconds WRITER_IDLE_SLEEP{50};
+
+struct EventRing
+{
+	alignas(64) std::atomic<size_t> head{0}; // next event the writer reads
+	alignas(64) std::atomic<size_t> tail{0}; // next slot the producer writes
+	std::atomic<bool> retired{false};        // producer thread has exited
+	OutputEvent events[OUTPUT_RING_SIZE];
+};
+
+struct LaterSequence
+{
+	bool operator()(const OutputEvent &a, const OutputEvent &b) const { return a.sequence > b.sequence; }
+};
+
+struct Writer
+{
+	OutputConfig config;
+	std::thread thread;
+	std::atomic<bool> stopping{false};
+	std::atomic<uint64_t> next_sequence{0};
+	ProfiledMutex<LockClass::Output> direct_mtx; // serialises synchronous writes
+
+	std::mutex rings_mtx;
+	std::vector<EventRing *> rings; // guarded by rings_mtx
+	std::atomic<uint64_t> rings_version{0};
+
+	void run();
+};
+
+Writer writer;
+
+struct RingOwner
+{
+	EventRing *ring = nullptr;
+
+	~RingOwner()
+	{
+		if (ring)
+			ring->retired.store(true, std::memory_order_release);
+	}
+};
+
+thread_local RingOwner ring_owner;
+
+EventRing *localRing()
+{
+	if (!ring_owner.ring)
+	{
+		ring_owner.ring = new EventRing();
+		std::scoped_lock lock(writer.rings_mtx);
+		writer.rings.push_back(ring_owner.ring);
+		writer.rings_version.fetch_add(1, std::memory_order_release);
+	}
+	return ring_owner.ring;
+}
+
+void writeAll(const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = write(STDOUT_FILENO, data, size);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+}
+
+void Writer::run()
+{
+	// OutputPipeline::stop joins this thread at exit, so exit signals must go to another thread
+	sigset_t exit_signals;
+	sigemptyset(&exit_signals);
+	sigaddset(&exit_signals, SIGINT);
+	sigaddset(&exit_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &exit_signals, nullptr);
+
+	std::vector<EventRing *> local_rings;
+	uint64_t seen_version = UINT64_MAX;
+	std::priority_queue<OutputEvent, std::vector<OutputEvent>, LaterSequence> pending;
+	uint64_t next = 0;
+
+	std::vector<char> buffer;
+	buffer.reserve(config.flush_bytes + OUTPUT_LINE_MAX);
+	auto oldest = std::chrono::steady_clock::now();
+
+	auto flush = [&]()
+	{
+		writeAll(buffer.data(), buffer.size());
+		buffer.clear();
+	};
+
+	auto emit = [&](const OutputEvent &event)
+	{
+		if (buffer.empty())
+			oldest = std::chrono::steady_clock::now();
+
+		size_t size = buffer.size();
+		buffer.resize(size + OUTPUT_LINE_MAX);
+		if (config.format == OutputFormat::Binary)
+			buffer.resize(size + encodeBinary(event, buffer.data() + size));
+		else
+			buffer.resize(size + formatText(event, buffer.data() + size));
+		if (buffer.size() >= config.flush_bytes)
+			flush();
+	};
+
+	while (true)
+	{
+		bool stop = stopping.load(std::memory_order_acquire);
+
+		if (rings_version.load(std::memory_order_acquire) != seen_version)
+		{
+			std::scoped_lock lock(rings_mtx);
+			seen_version = rings_version.load(std::memory_order_relaxed);
+			local_rings = rings;
+		}
+
+		size_t drained = 0;
+		bool reclaim = false;
+		for (EventRing *ring : local_rings)
+		{
+			bool retired = ring->retired.load(std::memory_order_acquire);
+			size_t head = ring->head.load(std::memory_order_relaxed);
+			size_t tail = ring->tail.load(std::memory_order_acquire);
+			for (; head != tail; ++head, ++drained)
+			{
+				pending.push(ring->events[head & (OUTPUT_RING_SIZE - 1)]);
+			}
+			ring->head.store(head, std::memory_order_release);
+			reclaim |= retired;
+		}
+
+		// events come out in sequence order; a gap means a producer has taken
+		// a sequence number but not pushed its event yet
+		while (!pending.empty() && pending.top().sequence == next)
+		{
+			emit(pending.top());
+			pending.pop();
+			++next;
+		}
+
+		if (reclaim)
+		{
+			// a ring can go once its thread has exited and it has been drained
+			std::scoped_lock lock(rings_mtx);
+			std::erase_if(rings, [](EventRing *ring)
+			{
+				if (!ring->retired.load(std::memory_order_acquire) ||
+				    ring->head.load(std::memory_order_relaxed) != ring->tail.load(std::memory_order_acquire))
+					return false;
+				delete ring;
+				return true;
+			});
+			rings_version.fetch_add(1, std::memory_order_release);
+		}
+
+		if (stop && drained == 0)
+		{
+			// nothing more is coming from the engine, write out what is left even across gaps
+			for (; !pending.empty(); pending.pop())
+				emit(pending.top());
+			flush();
+			return;
+		}
+
+		if (!buffer.empty() && std::chrono::steady_clock::now() - oldest >= config.flush_interval)
+			flush();
+
+		if (drained == 0)
+			std::this_thread::sleep_for(WRITER_IDLE_SLEEP);
+	}
+}
+
+char *appendNumber(char *out, uint64_t value)
+{
+	return std::to_chars(out, out + 20, value).ptr;
+}
+
+void put16(char *out, uint16_t value)
+{
+	for (size_t i = 0; i < 2; ++i)
+		out[i] = static_cast<char>(value >> (8 * i));
+}
+
+void put32(char *out, uint32_t value)
+{
+	for (size_t i = 0; i < 4; ++i)
+		out[i] = static_cast<char>(value >> (8 * i));
+}
+
+void put64(char *out, uint64_t value)
+{
+	for (size_t i = 0; i < 8; ++i)
+		out[i] = static_cast<char>(value >> (8 * i));
+}
+
+uint64_t get(const char *in, size_t bytes)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+	return value;
+}
+
+size_t recordSize(char kind)
+{
+	switch (kind)
+	{
+	case OutputEvent::AddedBuy:
+	case OutputEvent::AddedSell:
+	case OutputEvent::Executed:
+		return OUTPUT_RECORD_MAX;
+	case OutputEvent::Deleted:
+		return OUTPUT_RECORD_HEADER;
+	case OutputEvent::Amended:
+		return OUTPUT_RECORD_HEADER + 8;
+	default:
+		return 0;
+	}
+}
+
+} // namespace
+
+size_t formatText(const OutputEvent &event, char *out)
+{
+	char *p = out;
+	switch (event.kind)
+	{
+	case OutputEvent::AddedBuy:
+	case OutputEvent::AddedSell:
+		*p++ = event.kind;
+		*p++ = ' ';
+		p = appendNumber(p, event.id);
+		*p++ = ' ';
+		for (const char *c = event.symbol; *c; ++c)
+			*p++ = *c;
+		*p++ = ' ';
+		p = appendNumber(p, event.price);
+		*p++ = ' ';
+		p = appendNumber(p, event.count);
+		break;
+
+	case OutputEvent::Executed:
+		*p++ = 'E';
+		*p++ = ' ';
+		p = appendNumber(p, event.id);
+		*p++ = ' ';
+		p = appendNumber(p, event.new_id);
+		*p++ = ' ';
+		p = appendNumber(p, event.execution_id);
+		*p++ = ' ';
+		p = appendNumber(p, event.price);
+		*p++ = ' ';
+		p = appendNumber(p, event.count);
+		break;
+
+	case OutputEvent::Deleted:
+		*p++ = 'X';
+		*p++ = ' ';
+		p = appendNumber(p, event.id);
+		*p++ = ' ';
+		*p++ = event.accepted ? 'A' : 'R';
+		break;
+
+	case OutputEvent::Amended:
+		*p++ = 'M';
+		*p++ = ' ';
+		p = appendNumber(p, event.id);
+		*p++ = ' ';
+		*p++ = event.accepted ? 'A' : 'R';
+		*p++ = ' ';
+		p = appendNumber(p, event.price);
+		*p++ = ' ';
+		p = appendNumber(p, event.count);
+		break;
+	}
+
+	*p++ = ' ';
+	p = std::to_chars(p, p + 20, event.timestamp).ptr;
+	*p++ = '\n';
+	return static_cast<size_t>(p - out);
+}
+
+size_t encodeBinary(const OutputEvent &event, char *out)
+{
+	size_t size = recordSize(event.kind);
+	out[0] = event.kind;
+	out[1] = (event.kind == OutputEvent::Deleted || event.kind == OutputEvent::Amended) && event.accepted;
+	put16(out + 2, static_cast<uint16_t>(size));
+	put32(out + 4, event.id);
+	put64(out + 8, event.sequence);
+	put64(out + 16, static_cast<uint64_t>(event.timestamp));
+
+	char *body = out + OUTPUT_RECORD_HEADER;
+	switch (event.kind)
+	{
+	case OutputEvent::AddedBuy:
+	case OutputEvent::AddedSell:
+		put32(body, event.price);
+		put32(body + 4, event.count);
+		std::memcpy(body + 8, event.symbol, 8);
+		break;
+
+	case OutputEvent::Executed:
+		put32(body, event.new_id);
+		put32(body + 4, event.execution_id);
+		put32(body + 8, event.price);
+		put32(body + 12, event.count);
+		break;
+
+	case OutputEvent::Amended:
+		put32(body, event.price);
+		put32(body + 4, event.count);
+		break;
+
+	case OutputEvent::Deleted:
+		break;
+	}
+	return size;
+}
+
+size_t decodeBinary(const char *data, size_t size, OutputEvent &event)
+{
+	if (size < OUTPUT_RECORD_HEADER)
+		return 0;
+
+	size_t record = recordSize(data[0]);
+	if (record == 0 || get(data + 2, 2) != record)
+		return SIZE_MAX;
+	if (size < record)
+		return 0;
+
+	event = OutputEvent{};
+	event.kind = static_cast<OutputEvent::Kind>(data[0]);
+	event.accepted = data[1] != 0;
+	event.id = static_cast<uint32_t>(get(data + 4, 4));
+	event.sequence = get(data + 8, 8);
+	event.timestamp = static_cast<int64_t>(get(data + 16, 8));
+
+	const char *body = data + OUTPUT_RECORD_HEADER;
+	switch (event.kind)
+	{
+	case OutputEvent::AddedBuy:
+	case OutputEvent::AddedSell:
+		event.price = static_cast<uint32_t>(get(body, 4));
+		event.count = static_cast<uint32_t>(get(body + 4, 4));
+		std::memcpy(event.symbol, body + 8, 8);
+		break;
+
+	case OutputEvent::Executed:
+		event.new_id = static_cast<uint32_t>(get(body, 4));
+		event.execution_id = static_cast<uint32_t>(get(body + 4, 4));
+		event.price = static_cast<uint32_t>(get(body + 8, 4));
+		event.count = static_cast<uint32_t>(get(body + 12, 4));
+		break;
+
+	case OutputEvent::Amended:
+		event.price = static_cast<uint32_t>(get(body, 4));
+		event.count = static_cast<uint32_t>(get(body + 4, 4));
+		break;
+
+	case OutputEvent::Deleted:
+		break;
+	}
+	return record;
+}
+
+void OutputPipeline::start(const OutputConfig &config)
+{
+	writer.config = config;
+	if (config.async)
+		writer.thread = std::thread(&Writer::run, &writer);
+	active.store(true, std::memory_order_release);
+}
+
+void OutputPipeline::stop()
+{
+	if (!active.exchange(false))
+		return;
+
+	if (writer.thread.joinable())
+	{
+		writer.stopping.store(true, std::memory_order_release);
+		writer.thread.join();
+	}
+}
+
+void OutputPipeline::push(OutputEvent &event)
+{
+	if (!writer.config.async)
+	{
+		char out[OUTPUT_LINE_MAX];
+		std::scoped_lock lock(writer.direct_mtx);
+		event.sequence = writer.next_sequence.fetch_add(1, std::memory_order_relaxed);
+		size_t size = writer.config.format == OutputFormat::Binary ? encodeBinary(event, out) : formatText(event, out);
+		writeAll(out, size);
+		return;
+	}
+
+	EventRing *ring = localRing();
+	size_t tail = ring->tail.load(std::memory_order_relaxed);
+
+	// wait for space before taking a sequence number, so the writer never
+	// waits on an event stuck behind a full ring
+	while (tail - ring->head.load(std::memory_order_acquire) == OUTPUT_RING_SIZE)
+		std::this_thread::yield();
+
+	event.sequence = writer.next_sequence.fetch_add(1, std::memory_order_relaxed);
+	ring->events[tail & (OUTPUT_RING_SIZE - 1)] = event;
+	ring->tail.store(tail + 1, std::memory_order_release);
+}
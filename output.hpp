@@ -0,0 +1,111 @@
+// This file contains declarations for the asynchronous output pipeline,
+// which takes stdout I/O out of the engine's critical sections.
+
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * OutputEvent is a fixed-size record of one line of output.
+ * sequence orders events across threads; it is taken when the event is
+ * pushed, i.e. while the engine still holds the locks the event was made under.
+ */
+struct OutputEvent
+{
+	enum Kind : char
+	{
+		AddedBuy = 'B',
+		AddedSell = 'S',
+		Executed = 'E',
+		Deleted = 'X',
+		Amended = 'M'
+	};
+
+	uint64_t sequence;
+	int64_t timestamp;
+	uint32_t id;           // order added, deleted or amended, resting order executed
+	uint32_t new_id;       // Executed only
+	uint32_t execution_id; // Executed only
+	uint32_t price;
+	uint32_t count;
+	Kind kind;
+	bool accepted;         // Deleted and Amended only
+	char symbol[9];        // Added only
+};
+
+// Formats an event exactly like the Output class does, returns the length.
+size_t formatText(const OutputEvent &event, char *out);
+
+/*
+ * Binary records are little-endian with a fixed layout per kind:
+ *
+ *   0  u8  kind ('B', 'S', 'E', 'X' or 'M')
+ *   1  u8  accepted (X and M) or 0
+ *   2  u16 record size
+ *   4  u32 id
+ *   8  u64 sequence
+ *  16  i64 timestamp
+ *
+ * followed by u32 price, u32 count, char[8] symbol (zero padded) for B and S,
+ * by u32 new_id, u32 execution_id, u32 price, u32 count for E,
+ * by u32 price, u32 count for M, and by nothing for X.
+ */
+constexpr size_t OUTPUT_RECORD_HEADER = 24;
+constexpr size_t OUTPUT_RECORD_MAX = 40;
+
+// Encodes an event as a binary record, returns the length.
+size_t encodeBinary(const OutputEvent &event, char *out);
+
+// Decodes the binary record at the start of data. Returns its length,
+// 0 if data holds only part of it, SIZE_MAX if it is malformed.
+size_t decodeBinary(const char *data, size_t size, OutputEvent &event);
+
+enum class OutputFormat
+{
+	Text,  // the lines the Output class has always printed
+	Binary // records as laid out above, see decoder.cpp
+};
+
+constexpr size_t OUTPUT_LINE_MAX = 96;
+constexpr size_t OUTPUT_RING_SIZE = 8192; // events per producer thread, must be a power of two
+constexpr size_t OUTPUT_FLUSH_BYTES_DEFAULT = 1 << 16;
+constexpr std::chrono::microseconds OUTPUT_FLUSH_INTERVAL_DEFAULT{1000};
+
+struct OutputConfig
+{
+	OutputFormat format = OutputFormat::Text;
+	bool async = false; // hand events to a writer thread, or write each one as it comes
+	size_t flush_bytes = OUTPUT_FLUSH_BYTES_DEFAULT;                             // write once this much is buffered
+	std::chrono::microseconds flush_interval = OUTPUT_FLUSH_INTERVAL_DEFAULT; // or once the oldest line is this old
+};
+
+/*
+ * OutputPipeline takes over stdout from the Output class when the output is
+ * binary or asynchronous.
+ * Asynchronous output moves I/O off the engine threads. Each engine thread
+ * pushes events into its own lock-free single-producer ring; a writer thread
+ * drains every ring, puts the events back in sequence order, formats them and
+ * writes them to stdout in large batches.
+ * Synchronous binary output encodes and writes each event under a mutex.
+ */
+class OutputPipeline
+{
+public:
+	static void start(const OutputConfig &config);
+
+	// Writes out everything pushed so far and stops the writer, if any.
+	static void stop();
+
+	static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+	static void push(OutputEvent &event);
+
+private:
+	static std::atomic<bool> active;
+};
+
+#endif
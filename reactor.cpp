@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "reactor.hpp"
+
+Reactor::Reactor(Engine &engine, size_t thread_count) : engine(engine), loops(), next_loop(0)
+{
+	for (size_t i = 0; i < thread_count; ++i)
+	{
+		auto loop = std::make_unique<Loop>();
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd == -1)
+		{
+			perror("epoll_create1");
+			exit(1);
+		}
+		loop->thread = std::thread(&Reactor::loop_thread, this, loop.get());
+		loop->thread.detach();
+		loops.push_back(std::move(loop));
+	}
+}
+
+bool Reactor::add(ClientConnection conn)
+{
+	int fd = conn.handle();
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+	{
+		perror("fcntl");
+		return false;
+	}
+
+	auto *connection = new ReactorConnection(std::move(conn));
+	Loop *loop = loops[next_loop].get();
+	next_loop = (next_loop + 1) % loops.size();
+
+	struct epoll_event event {};
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.ptr = connection;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+	{
+		perror("epoll_ctl");
+		delete connection;
+		return false;
+	}
+	return true;
+}
+
+void Reactor::loop_thread(Loop *loop)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	while (true)
+	{
+		int ready = epoll_wait(loop->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+		if (ready == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return;
+		}
+
+		for (int i = 0; i < ready; ++i)
+		{
+			auto *connection = static_cast<ReactorConnection *>(events[i].data.ptr);
+			if (!serve(connection))
+			{
+				// shards may still be working on its commands
+				Engine::drain(connection->session);
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->conn.handle(), nullptr);
+				delete connection;
+			}
+		}
+	}
+}
+
+/*
+ * Reads what is available from a ready connection and dispatches every whole
+ * command received. Returns false once the connection is finished.
+ * Level triggered: one read per wakeup, so a busy client cannot starve the others.
+ */
+bool Reactor::serve(ReactorConnection *connection)
+{
+	std::span<const ClientCommand> batch;
+	int64_t read_start = LatencyStats::clock();
+	switch (connection->conn.readBatch(batch))
+	{
+	case ReadResult::WouldBlock:
+		return true;
+	case ReadResult::Error:
+		SyncCerr{} << "Error reading input" << std::endl;
+		return false;
+	case ReadResult::EndOfFile:
+		return false;
+	case ReadResult::Success:
+		break;
+	}
+	LatencyStats::recordReadSince(read_start);
+
+	engine.dispatch(batch, connection->session);
+	return true;
+}
@@ -0,0 +1,62 @@
+// This file contains declarations for the epoll based I/O mode, where a fixed
+// pool of reactor threads serves all client connections.
+
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "io.hpp"
+#include "engine.hpp"
+
+constexpr size_t REACTOR_THREADS_DEFAULT = 2;
+constexpr int REACTOR_MAX_EVENTS = 64;
+
+/*
+ * ReactorConnection is the state a reactor keeps per client: the connection,
+ * which buffers partly received commands, and its session with the engine.
+ */
+struct ReactorConnection
+{
+	ClientConnection conn;
+	ClientSession session;
+
+	explicit ReactorConnection(ClientConnection conn) : conn(std::move(conn)), session() {}
+};
+
+/*
+ * Reactor multiplexes client connections over a fixed number of threads, each
+ * running its own epoll loop on non-blocking sockets. New connections are
+ * assigned to the threads round robin and stay there, so the commands of a
+ * client are still handled in order by a single thread.
+ */
+class Reactor
+{
+public:
+	Reactor(Engine &engine, size_t thread_count);
+
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+
+	// Takes over a connection accepted by main().
+	bool add(ClientConnection conn);
+
+private:
+	struct Loop
+	{
+		int epoll_fd;
+		std::thread thread;
+	};
+
+	Engine &engine;
+	std::vector<std::unique_ptr<Loop>> loops;
+	size_t next_loop;
+
+	void loop_thread(Loop *loop);
+	bool serve(ReactorConnection *connection);
+};
+
+#endif
@@ -0,0 +1,472 @@
+// Drives the engine in-process from a test script, without sockets or client
+// processes, and reports throughput, latency percentiles and a digest of the
+// output to stderr.
+//
+// Scripts are in the format of scripts/*.in and tests/*.in: commands are
+// "[<client>] B|S <id> <instrument> <price> <count>", "[<client>] C <id>" or
+// "[<client>] A <id> <price> <count>".
+// The commands are decoded up front. Every client is pinned to one of the
+// threads, which runs the commands of its clients in script order, so each
+// client's commands still run in order.
+//
+// The ordered digest hashes the output lines in order and is only
+// reproducible with one thread in locking mode (shards run the commands of
+// different clients concurrently). The unordered digest hashes them as a set,
+// so it also matches across runs whose lines come out interleaved differently;
+// with several threads, it is reproducible as long as the outcome of the
+// matching does not depend on timing, e.g. when each instrument is traded by
+// a single client. Timestamps are left out of both.
+//
+// Latency is the time dispatch takes. In sharded mode that is only the time
+// to queue a command for its shard; throughput still counts until the shards
+// are done.
+//
+// --batch=<count> hands each client's commands to dispatch in batches of up to
+// count, as a connection does with what one read returns, instead of one by
+// one. The output must be the same either way; make check compares them. A
+// batch's latency is split evenly between its commands.
+//
+// --check-snapshots reads the published top of book of every instrument from
+// another thread while the script runs and fails if a book is ever crossed,
+// or if the levels published last differ from the books once it is done.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "io.hpp"
+#include "engine.hpp"
+#include "snapshot.hpp"
+
+struct ScriptCommand
+{
+	size_t client;
+	ClientCommand input;
+};
+
+struct Worker
+{
+	std::vector<ScriptCommand> commands;
+	std::vector<ClientCommand> inputs; // the commands alone, to dispatch in batches
+	std::vector<uint64_t> latencies; // ns per command
+	std::thread thread;
+};
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr,
+	    "Usage: %s [--threads=<count>] [--engine=locking|sharded] [--shards=<count>] [--output=sync|async]\n"
+	    "          [--batch=<count>] [--check-snapshots] [--print] <script>\n",
+	    argv0);
+}
+
+// Reads a script, returns false on a line it does not understand.
+static bool parseScript(const char* path, std::vector<ScriptCommand>& commands, size_t& clients)
+{
+	std::ifstream in(path);
+	if(!in)
+	{
+		perror(path);
+		return false;
+	}
+
+	std::string line;
+	size_t line_number = 0;
+	clients = 1;
+	while(std::getline(in, line))
+	{
+		++line_number;
+		std::istringstream fields(line);
+		std::string word;
+		if(!(fields >> word) || word == "o" || word == "x" || word[0] == '#')
+			continue;
+
+		ScriptCommand command{};
+		if(isdigit(static_cast<unsigned char>(word[0])))
+		{
+			// a number alone is the client count of the script
+			if(!(fields >> word))
+				continue;
+			command.client = strtoul(line.c_str(), NULL, 10);
+		}
+
+		ClientCommand& input = command.input;
+		std::string instrument;
+		bool ok;
+		if(word == "B" || word == "S")
+		{
+			input.type = word == "B" ? input_buy : input_sell;
+			ok = static_cast<bool>(fields >> input.order_id >> instrument >> input.price >> input.count) &&
+			    instrument.size() < sizeof(input.instrument);
+			if(ok)
+				memcpy(input.instrument, instrument.c_str(), instrument.size() + 1);
+		}
+		else if(word == "C")
+		{
+			input.type = input_cancel;
+			ok = static_cast<bool>(fields >> input.order_id);
+		}
+		else if(word == "A")
+		{
+			input.type = input_amend;
+			ok = static_cast<bool>(fields >> input.order_id >> input.price >> input.count);
+		}
+		else
+			ok = false;
+
+		if(!ok)
+		{
+			fprintf(stderr, "%s:%zu: cannot parse \"%s\"\n", path, line_number, line.c_str());
+			return false;
+		}
+		clients = std::max(clients, command.client + 1);
+		commands.push_back(command);
+	}
+	return true;
+}
+
+static uint64_t hashLine(const char* line, size_t size)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash ^= static_cast<unsigned char>(line[i]);
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double fraction)
+{
+	if(sorted.empty())
+		return 0;
+	size_t index = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+struct SnapshotCheck
+{
+	uint64_t reads = 0;
+	uint64_t crossed = 0;
+	size_t books = 0;
+	size_t mismatched = 0;
+};
+
+// Reads the published top of book of every instrument of the script until done,
+// counting the reads that see a crossed book.
+static void readSnapshots(const Engine& engine, const std::vector<ScriptCommand>& commands, const std::atomic<bool>& done, SnapshotCheck& check)
+{
+	std::vector<std::string> instruments;
+	for(const ScriptCommand& command : commands)
+	{
+		if(command.input.type == input_buy || command.input.type == input_sell)
+			instruments.push_back(command.input.instrument);
+	}
+	std::sort(instruments.begin(), instruments.end());
+	instruments.erase(std::unique(instruments.begin(), instruments.end()), instruments.end());
+
+	while(!done.load(std::memory_order_acquire))
+	{
+		for(const std::string& instrument : instruments)
+		{
+			BookSnapshot snapshot;
+			if(!engine.snapshot(instrument.c_str(), snapshot))
+				continue;
+			++check.reads;
+			if(snapshot.bid_levels > 0 && snapshot.ask_levels > 0 && snapshot.bids[0].price >= snapshot.asks[0].price)
+				++check.crossed;
+		}
+		std::this_thread::yield();
+	}
+}
+
+// Compares the levels last published for every book with the book itself.
+static void compareSnapshots(Engine& engine, SnapshotCheck& check)
+{
+	engine.orderBooks.forEach([&](OrderBook* book)
+	{
+		std::vector<char> data;
+		engine.capture(book, data);
+		const char* at = data.data();
+		auto saved = snapshotGet<SnapshotBook>(at);
+
+		// the book's top levels, as capture lists them best first
+		DepthLevel levels[2][BOOK_SNAPSHOT_DEPTH];
+		size_t level_counts[2] = {0, 0};
+		for(size_t side = 0; side < 2; ++side)
+		{
+			uint32_t side_levels = side == 0 ? saved.bid_levels : saved.ask_levels;
+			for(uint32_t i = 0; i < side_levels; ++i)
+			{
+				auto saved_level = snapshotGet<SnapshotLevel>(at);
+				DepthLevel level{saved_level.price, 0, saved_level.orders};
+				for(uint32_t j = 0; j < saved_level.orders; ++j)
+					level.volume += snapshotGet<SnapshotOrder>(at).count;
+				if(i < BOOK_SNAPSHOT_DEPTH)
+					levels[side][level_counts[side]++] = level;
+			}
+		}
+
+		char name[9];
+		unpackSymbol(saved.symbol, name);
+		BookSnapshot snapshot;
+		bool match = engine.snapshot(name, snapshot) && snapshot.bid_levels == level_counts[0] && snapshot.ask_levels == level_counts[1];
+		for(size_t side = 0; match && side < 2; ++side)
+		{
+			const DepthLevel* published = side == 0 ? snapshot.bids : snapshot.asks;
+			for(size_t i = 0; i < level_counts[side]; ++i)
+			{
+				if(published[i].price != levels[side][i].price || published[i].volume != levels[side][i].volume ||
+				    published[i].orders != levels[side][i].orders)
+					match = false;
+			}
+		}
+		++check.books;
+		if(!match)
+		{
+			fprintf(stderr, "published levels of %s differ from the book\n", name);
+			++check.mismatched;
+		}
+	});
+}
+
+int main(int argc, char* argv[])
+{
+	static const struct option long_options[] = {
+		{ "threads", required_argument, NULL, 'n' },
+		{ "engine", required_argument, NULL, 'e' },
+		{ "shards", required_argument, NULL, 's' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "check-snapshots", no_argument, NULL, 'c' },
+		{ "print", no_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	size_t thread_count = 1;
+	EngineMode mode = EngineMode::Locking;
+	size_t shard_count = SHARD_COUNT_DEFAULT;
+	OutputConfig output_config;
+	size_t batch_size = 0; // 0: one command at a time
+	bool check_snapshots = false;
+	bool print = false;
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'n':
+				thread_count = strtoul(optarg, NULL, 10);
+				if(thread_count == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'e':
+				if(strcmp(optarg, "locking") == 0)
+					mode = EngineMode::Locking;
+				else if(strcmp(optarg, "sharded") == 0)
+					mode = EngineMode::Sharded;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 's':
+				shard_count = strtoul(optarg, NULL, 10);
+				if(shard_count == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'o':
+				if(strcmp(optarg, "sync") == 0)
+					output_config.async = false;
+				else if(strcmp(optarg, "async") == 0)
+					output_config.async = true;
+				else
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'b':
+				batch_size = strtoul(optarg, NULL, 10);
+				if(batch_size == 0)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'c': check_snapshots = true; break;
+			case 'p': print = true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<ScriptCommand> commands;
+	size_t clients;
+	if(!parseScript(argv[optind], commands, clients))
+		return 1;
+
+	std::vector<Worker> workers(thread_count);
+	for(const ScriptCommand& command : commands)
+	{
+		workers[command.client % thread_count].commands.push_back(command);
+		workers[command.client % thread_count].inputs.push_back(command.input);
+	}
+	for(Worker& worker : workers)
+		worker.latencies.resize(worker.commands.size());
+
+	// the engine writes to stdout: catch it in memory to digest it afterwards
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int capture_fd = memfd_create("replay-output", MFD_CLOEXEC);
+	if(saved_stdout == -1 || capture_fd == -1 || dup2(capture_fd, STDOUT_FILENO) == -1)
+	{
+		perror("capturing output");
+		return 1;
+	}
+
+	Timestamp::init(ClockSource::Steady);
+	if(output_config.async)
+		OutputPipeline::start(output_config);
+	auto engine = new Engine(mode, shard_count);
+
+	std::atomic<bool> go{false};
+	for(Worker& worker : workers)
+	{
+		worker.thread = std::thread([&engine, &go, &worker, clients, batch_size]()
+		{
+			std::vector<ClientSession> sessions(clients);
+			while(!go.load(std::memory_order_acquire))
+				;
+
+			for(size_t i = 0; i < worker.commands.size();)
+			{
+				const ScriptCommand& command = worker.commands[i];
+				size_t count = 1;
+				while(count < batch_size && i + count < worker.commands.size() && worker.commands[i + count].client == command.client)
+					++count;
+
+				auto start = std::chrono::steady_clock::now();
+				if(batch_size)
+					engine->dispatch(std::span<const ClientCommand>(worker.inputs).subspan(i, count), sessions[command.client]);
+				else
+					engine->dispatch(command.input, sessions[command.client]);
+				uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+				for(size_t j = 0; j < count; ++j)
+					worker.latencies[i + j] = elapsed / count;
+				i += count;
+			}
+
+			// sharded: the commands are done once their shards are
+			for(ClientSession& session : sessions)
+				Engine::drain(session);
+		});
+	}
+
+	std::atomic<bool> done{false};
+	SnapshotCheck snapshot_check;
+	std::thread reader;
+	if(check_snapshots)
+		reader = std::thread([&engine, &done, &commands, &snapshot_check]() { readSnapshots(*engine, commands, done, snapshot_check); });
+
+	auto start = std::chrono::steady_clock::now();
+	go.store(true, std::memory_order_release);
+	for(Worker& worker : workers)
+		worker.thread.join();
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if(check_snapshots)
+	{
+		done.store(true, std::memory_order_release);
+		reader.join();
+		compareSnapshots(*engine, snapshot_check);
+	}
+
+	OutputPipeline::stop();
+	std::cout.flush();
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+
+	// digest the captured output, without the timestamps
+	off_t size = lseek(capture_fd, 0, SEEK_END);
+	const char* output = static_cast<const char*>(size > 0 ? mmap(NULL, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, capture_fd, 0) : NULL);
+	if(output == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	uint64_t ordered = 0xcbf29ce484222325ULL;
+	uint64_t unordered = 0;
+	size_t lines = 0;
+	for(const char* line = output; line && line < output + size;)
+	{
+		const char* end = static_cast<const char*>(memchr(line, '\n', static_cast<size_t>(output + size - line)));
+		if(!end)
+			end = output + size;
+		const char* last_space = line;
+		for(const char* c = line; c < end; ++c)
+			if(*c == ' ')
+				last_space = c;
+
+		uint64_t hash = hashLine(line, static_cast<size_t>(last_space - line));
+		ordered = (ordered ^ hash) * 0x100000001b3ULL;
+		unordered += hash;
+		++lines;
+		if(print)
+		{
+			fwrite(line, 1, static_cast<size_t>(last_space - line), stdout);
+			fputc('\n', stdout);
+		}
+		line = end + 1;
+	}
+
+	std::vector<uint64_t> latencies;
+	latencies.reserve(commands.size());
+	for(const Worker& worker : workers)
+		latencies.insert(latencies.end(), worker.latencies.begin(), worker.latencies.end());
+	std::sort(latencies.begin(), latencies.end());
+
+	fprintf(stderr, "commands %zu clients %zu threads %zu engine %s time %.6f s throughput %.0f commands/s\n",
+	    commands.size(), clients, thread_count, mode == EngineMode::Sharded ? "sharded" : "locking", elapsed,
+	    static_cast<double>(commands.size()) / elapsed);
+	fprintf(stderr, "latency ns p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+	    (unsigned long long) percentile(latencies, 0.5), (unsigned long long) percentile(latencies, 0.9),
+	    (unsigned long long) percentile(latencies, 0.99), (unsigned long long) percentile(latencies, 0.999),
+	    (unsigned long long) (latencies.empty() ? 0 : latencies.back()));
+	fprintf(stderr, "output lines %zu digest ordered %016llx unordered %016llx\n",
+	    lines, (unsigned long long) ordered, (unsigned long long) unordered);
+	if(check_snapshots)
+	{
+		fprintf(stderr, "snapshots reads %llu crossed %llu books %zu mismatched %zu\n",
+		    (unsigned long long) snapshot_check.reads, (unsigned long long) snapshot_check.crossed,
+		    snapshot_check.books, snapshot_check.mismatched);
+		if(snapshot_check.crossed || snapshot_check.mismatched)
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.hpp"
+#include "snapshot.hpp"
+
+namespace
+{
+
+constexpr char SNAPSHOT_MAGIC[8] = {'O', 'B', 'S', 'N', 'A', 'P', '0', '1'};
+
+bool writeAll(int fd, const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = ::write(fd, data, size);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+
+// Walks the books that follow the header, checking every count against the
+// bytes left, so restoring them cannot read past the end of the file.
+bool snapshotComplete(const char *data, const char *end, uint32_t book_count)
+{
+	for (uint32_t i = 0; i < book_count; ++i)
+	{
+		if (static_cast<size_t>(end - data) < sizeof(SnapshotBook))
+			return false;
+		auto book = snapshotGet<SnapshotBook>(data);
+		uint64_t level_count = uint64_t(book.bid_levels) + book.ask_levels;
+		for (uint64_t j = 0; j < level_count; ++j)
+		{
+			if (static_cast<size_t>(end - data) < sizeof(SnapshotLevel))
+				return false;
+			auto level = snapshotGet<SnapshotLevel>(data);
+			if (static_cast<size_t>(end - data) / sizeof(SnapshotOrder) < level.orders)
+				return false;
+			data += level.orders * sizeof(SnapshotOrder);
+		}
+	}
+	return data == end;
+}
+
+} // namespace
+
+bool RestoredSnapshot::covers(uint64_t command_sequence, const ClientCommand &command) const
+{
+	if (command_sequence <= sequence)
+		return true;
+	auto it = books.find(packSymbol(command.instrument));
+	return it != books.end() && command_sequence <= it->second;
+}
+
+bool loadSnapshot(Engine &engine, const char *path, RestoredSnapshot &restored)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno == ENOENT)
+			return true;
+		perror(path);
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		perror("fstat");
+		close(fd);
+		return false;
+	}
+	size_t size = static_cast<size_t>(st.st_size);
+	if (size < sizeof(SnapshotHeader))
+	{
+		fprintf(stderr, "%s is not a snapshot\n", path);
+		close(fd);
+		return false;
+	}
+
+	void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+	{
+		perror("mmap");
+		return false;
+	}
+
+	const char *data = static_cast<const char *>(mapped);
+	auto header = snapshotGet<SnapshotHeader>(data);
+	if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header.size != size)
+	{
+		fprintf(stderr, "%s is not a snapshot\n", path);
+		munmap(mapped, size);
+		return false;
+	}
+	if (!snapshotComplete(data, static_cast<const char *>(mapped) + size, header.book_count))
+	{
+		fprintf(stderr, "%s is truncated or corrupt\n", path);
+		munmap(mapped, size);
+		return false;
+	}
+
+	restored.sequence = header.sequence;
+	for (uint32_t i = 0; i < header.book_count; ++i)
+	{
+		uint64_t symbol, sequence;
+		data = engine.restore(data, symbol, sequence);
+		restored.books[symbol] = sequence;
+		restored.newest = std::max(restored.newest, sequence);
+	}
+	munmap(mapped, size);
+	return true;
+}
+
+SnapshotWriter::SnapshotWriter(Engine &engine, const char *path, std::chrono::milliseconds interval)
+	: engine(engine), path(path), interval(interval), thread()
+{
+	thread = std::thread(&SnapshotWriter::writer_thread, this);
+	thread.detach();
+}
+
+void SnapshotWriter::writer_thread()
+{
+	std::vector<char> data;
+	while (true)
+	{
+		std::this_thread::sleep_for(interval);
+
+		// read before the first book is captured, so every book is at least this far along
+		SnapshotHeader header{};
+		std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+		header.sequence = Journal::sequence();
+
+		data.assign(sizeof(SnapshotHeader), 0);
+		uint64_t newest = 0;
+		engine.orderBooks.forEach([&](OrderBook *book)
+		{
+			size_t at = data.size();
+			engine.capture(book, data);
+			const char *saved = data.data() + at;
+			newest = std::max(newest, snapshotGet<SnapshotBook>(saved).sequence);
+			++header.book_count;
+		});
+
+		header.size = data.size();
+		std::memcpy(data.data(), &header, sizeof(header));
+
+		// the journal must be durable as far as the snapshot goes before the snapshot is
+		Journal::syncThrough(newest);
+		write(data);
+	}
+}
+
+bool SnapshotWriter::write(const std::vector<char> &data)
+{
+	std::string partial = path + ".tmp";
+	int fd = open(partial.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		perror(partial.c_str());
+		return false;
+	}
+	if (!writeAll(fd, data.data(), data.size()) || fdatasync(fd) == -1)
+	{
+		perror(partial.c_str());
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	if (rename(partial.c_str(), path.c_str()) == -1)
+	{
+		perror("rename");
+		return false;
+	}
+
+	// make the rename itself durable
+	std::string directory = path;
+	int dir_fd = open(dirname(directory.data()), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd != -1)
+	{
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return true;
+}
@@ -0,0 +1,124 @@
+// This file contains declarations for book snapshots, which let a restart
+// replay only the end of the journal instead of all of it.
+
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.hpp"
+
+constexpr std::chrono::milliseconds SNAPSHOT_INTERVAL_DEFAULT{10000};
+
+/*
+ * A snapshot file is a SnapshotHeader followed by every book: a SnapshotBook,
+ * then its bid levels and its ask levels, best first, each a SnapshotLevel
+ * followed by its orders in FIFO order. Fields are in host byte order and
+ * packed without padding.
+ *
+ * Books are captured one at a time, each under its own locks (or by its shard),
+ * so matching is only held up one book at a time. A book therefore reflects
+ * the journal up to its own sequence number; every book in the file was
+ * captured after the journal reached the header's sequence number.
+ */
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t book_count;
+	uint32_t reserved;
+	uint64_t sequence; // journal sequence number when the snapshot began
+	uint64_t size;     // of the whole file
+};
+
+struct SnapshotBook
+{
+	uint64_t symbol;   // packed, see packSymbol
+	uint64_t sequence; // last journaled command the book reflects
+	uint32_t bid_levels;
+	uint32_t ask_levels;
+};
+
+struct SnapshotLevel
+{
+	uint32_t price;
+	uint32_t orders;
+};
+
+struct SnapshotOrder
+{
+	uint32_t order_id;
+	uint32_t count;
+	uint32_t execution_id;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32);
+static_assert(sizeof(SnapshotBook) == 24);
+static_assert(sizeof(SnapshotLevel) == 8);
+static_assert(sizeof(SnapshotOrder) == 12);
+
+// Appends a snapshot field to out.
+template <typename T>
+void snapshotPut(std::vector<char> &out, const T &value)
+{
+	const char *bytes = reinterpret_cast<const char *>(&value);
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// Reads a snapshot field and moves data past it.
+template <typename T>
+T snapshotGet(const char *&data)
+{
+	T value;
+	std::memcpy(&value, data, sizeof(T));
+	data += sizeof(T);
+	return value;
+}
+
+/*
+ * RestoredSnapshot tells which journaled commands a loaded snapshot already
+ * reflects: those up to sequence, and those of each book up to its own
+ * sequence. Books the snapshot does not have were created after it began.
+ */
+struct RestoredSnapshot
+{
+	uint64_t sequence = 0;
+	uint64_t newest = 0; // greatest sequence of any book
+	std::unordered_map<uint64_t, uint64_t> books; // symbol -> sequence
+
+	bool covers(uint64_t sequence, const ClientCommand &command) const;
+};
+
+// Rebuilds the books of engine from the snapshot at path, if there is one.
+// Returns false, having reported why, if the snapshot cannot be used.
+bool loadSnapshot(Engine &engine, const char *path, RestoredSnapshot &restored);
+
+/*
+ * SnapshotWriter writes a snapshot of every book every interval. It is written
+ * next to path and renamed over it once complete and synced, so path always
+ * holds the newest complete snapshot.
+ */
+class SnapshotWriter
+{
+public:
+	SnapshotWriter(Engine &engine, const char *path, std::chrono::milliseconds interval);
+
+	SnapshotWriter(const SnapshotWriter &) = delete;
+	SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+private:
+	Engine &engine;
+	std::string path;
+	std::chrono::milliseconds interval;
+	std::thread thread;
+
+	void writer_thread();
+	bool write(const std::vector<char> &data);
+};
+
+#endif